@@ -0,0 +1,618 @@
+#include <platform.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifdef PLATFORM_WINDOWS
+#include <psapi.h>
+#endif
+
+// allocator benchmark: every workload runs against the vmm general heap, the
+// vmm heap with the thread cache enabled and the system malloc. reported per
+// run are throughput, sampled per call latency percentiles, the resident set
+// growth at the workload's peak and its ratio to the bytes that were live at
+// that point (fragmentation, 1.0 is no overhead at all)
+
+struct allocator_api {
+	const char* name;
+	void* (*alloc)(size_t);
+	void  (*free)(void*);
+	void* (*realloc)(void*, size_t);
+	bool  thread_cache;
+};
+
+static const allocator_api allocators[] = {
+	{ "vmm",        halloc, hfree, hrealloc, false },
+	{ "vmm+tcache", halloc, hfree, hrealloc, true },
+	{ "system",     malloc, free,  realloc,  false },
+};
+
+static size_t current_rss() {
+#ifdef PLATFORM_WINDOWS
+	PROCESS_MEMORY_COUNTERS counters = {};
+	K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.WorkingSetSize;
+#elif defined(PLATFORM_LINUX)
+	size_t pages = 0, resident = 0;
+	if (FILE* f = fopen("/proc/self/statm", "r")) {
+		if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static size_t peak_rss() {
+#ifdef PLATFORM_WINDOWS
+	PROCESS_MEMORY_COUNTERS counters = {};
+	K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.PeakWorkingSetSize;
+#elif defined(PLATFORM_LINUX)
+	size_t peak = 0;
+	if (FILE* f = fopen("/proc/self/status", "r")) {
+		char line[256];
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "VmHWM: %zu kB", &peak) == 1) {
+				peak *= 1024;
+				break;
+			}
+		}
+		fclose(f);
+	}
+	return peak;
+#endif
+}
+
+using bench_clock = std::chrono::steady_clock;
+
+// every sample_every'th call is timed, timing each one would mostly measure the clock
+struct run_stats {
+	static constexpr size_t sample_every = 16;
+
+	size_t ops = 0;
+	double seconds = 0;
+	std::vector<u32> samples;
+	size_t rss_base = 0;
+	size_t rss_peak = 0;
+	size_t live_at_peak = 0;
+
+	template <typename fn_t>
+	FORCE_INLINE auto timed(fn_t&& fn) {
+		if (++ops % sample_every)
+			return fn();
+
+		auto start = bench_clock::now();
+		auto result = fn();
+		samples.push_back((u32)std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count());
+		return result;
+	}
+
+	void peak(size_t live_bytes) {
+		size_t rss = current_rss();
+		if (rss > rss_peak) {
+			rss_peak = rss;
+			live_at_peak = live_bytes;
+		}
+	}
+
+	u32 percentile(double p) const {
+		if (samples.empty())
+			return 0;
+
+		return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+	}
+
+	void report(const char* workload, const char* allocator) {
+		std::sort(samples.begin(), samples.end());
+
+		double growth = rss_peak > rss_base ? (double)(rss_peak - rss_base) : 0.0;
+		double fragmentation = live_at_peak ? growth / live_at_peak : 0.0;
+
+		printf("%-18s %-11s %12.0f ops/s  p50 %6u ns  p99 %8u ns  p999 %9u ns  rss +%7.1f MB  frag %5.2f\n",
+			workload, allocator, ops / seconds,
+			percentile(0.50), percentile(0.99), percentile(0.999),
+			growth / (1024 * 1024), fragmentation);
+	}
+};
+
+struct void_result { int unused; };
+
+// sizes follow what gameplay code allocates: mostly small, a long tail up to max_size
+static size_t random_size(std::mt19937_64& rng, size_t max_size) {
+	u32 shift = 4 + (u32)(rng() % 8);
+	size_t size = (size_t)1 << shift;
+	size += rng() % size;
+	if (rng() % 64 == 0)
+		size = 1 + rng() % max_size;
+
+	return std::min(size, max_size);
+}
+
+static void churn(const allocator_api& api, run_stats& stats, size_t max_size, size_t slots, size_t iterations) {
+	std::mt19937_64 rng(42);
+	std::vector<void*> live(slots, nullptr);
+	std::vector<size_t> sizes(slots, 0);
+	size_t live_bytes = 0;
+
+	auto start = bench_clock::now();
+
+	for (size_t i = 0; i < iterations; ++i) {
+		size_t slot = rng() % slots;
+
+		if (live[slot]) {
+			stats.timed([&] { api.free(live[slot]); return void_result{}; });
+			live_bytes -= sizes[slot];
+		}
+
+		size_t size = random_size(rng, max_size);
+		live[slot] = stats.timed([&] { return api.alloc(size); });
+		memset(live[slot], 1, std::min<size_t>(size, 64));
+		sizes[slot] = size;
+		live_bytes += size;
+
+		if (i % 65536 == 0)
+			stats.peak(live_bytes);
+	}
+
+	stats.peak(live_bytes);
+	stats.seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+	for (void* p : live)
+		api.free(p);
+}
+
+// one thread allocates and hands batches to another that frees them, every
+// free is a cross thread free
+static void producer_consumer(const allocator_api& api, run_stats& stats, size_t total) {
+	constexpr size_t batch_size = 256;
+	constexpr size_t max_queued = 64;
+
+	struct batch_t {
+		std::vector<void*> blocks;
+		size_t bytes = 0;
+	};
+
+	std::mutex lock;
+	std::condition_variable cv;
+	std::vector<batch_t> queue;
+	std::atomic<size_t> live_bytes = 0;
+	bool done = false;
+
+	std::thread consumer([&] {
+		if (api.thread_cache)
+			htcache_enable();
+
+		for (;;) {
+			batch_t batch;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				cv.wait(guard, [&] { return !queue.empty() || done; });
+
+				if (queue.empty())
+					break;
+
+				batch = std::move(queue.back());
+				queue.pop_back();
+			}
+			cv.notify_all();
+
+			for (void* p : batch.blocks)
+				api.free(p);
+
+			live_bytes -= batch.bytes;
+		}
+
+		if (api.thread_cache)
+			htcache_disable();
+	});
+
+	std::mt19937_64 rng(7);
+	auto start = bench_clock::now();
+
+	for (size_t produced = 0; produced < total; produced += batch_size) {
+		batch_t batch;
+		batch.blocks.resize(batch_size);
+
+		for (size_t i = 0; i < batch_size; ++i) {
+			size_t size = random_size(rng, 4096);
+			batch.blocks[i] = stats.timed([&] { return api.alloc(size); });
+			memset(batch.blocks[i], 2, std::min<size_t>(size, 64));
+			batch.bytes += size;
+		}
+
+		live_bytes += batch.bytes;
+
+		std::unique_lock<std::mutex> guard(lock);
+		cv.wait(guard, [&] { return queue.size() < max_queued; });
+		queue.push_back(std::move(batch));
+		cv.notify_all();
+
+		if (produced % (batch_size * 256) == 0) {
+			guard.unlock();
+			stats.peak(live_bytes);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+	}
+	cv.notify_all();
+	consumer.join();
+
+	stats.seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// buffers that keep growing the way dynamic arrays do, interleaved so none of
+// them can always grow in place
+static void realloc_growth(const allocator_api& api, run_stats& stats, size_t buffers, size_t max_size, size_t rounds) {
+	std::vector<void*> live(buffers, nullptr);
+	std::vector<size_t> sizes(buffers, 0);
+
+	auto start = bench_clock::now();
+
+	for (size_t round = 0; round < rounds; ++round) {
+		for (size_t size = 64; size <= max_size; size += size / 2) {
+			size_t live_bytes = 0;
+
+			for (size_t b = 0; b < buffers; ++b) {
+				live[b] = stats.timed([&] { return api.realloc(live[b], size); });
+				((char*)live[b])[size - 1] = 3;
+				sizes[b] = size;
+				live_bytes += size;
+			}
+
+			stats.peak(live_bytes);
+		}
+
+		for (size_t b = 0; b < buffers; ++b) {
+			stats.timed([&] { api.free(live[b]); return void_result{}; });
+			live[b] = nullptr;
+		}
+	}
+
+	stats.seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// the 50k entity stress test: every entity owns a transform, a render and a
+// physics component, half of them die and respawn every frame
+static void entity_spawn(const allocator_api& api, run_stats& stats, size_t entities, size_t frames) {
+	constexpr size_t component_sizes[] = { 64, 128, 48, 96 };
+	constexpr size_t per_entity = sizeof(component_sizes) / sizeof(component_sizes[0]);
+	constexpr size_t entity_bytes = 64 + 128 + 48 + 96;
+
+	std::mt19937_64 rng(3);
+	std::vector<void*> parts(entities * per_entity, nullptr);
+
+	auto spawn = [&](size_t e) {
+		for (size_t c = 0; c < per_entity; ++c) {
+			void*& slot = parts[e * per_entity + c];
+			slot = stats.timed([&] { return api.alloc(component_sizes[c]); });
+			memset(slot, 4, component_sizes[c]);
+		}
+	};
+
+	auto kill = [&](size_t e) {
+		for (size_t c = 0; c < per_entity; ++c) {
+			void*& slot = parts[e * per_entity + c];
+			stats.timed([&] { api.free(slot); return void_result{}; });
+			slot = nullptr;
+		}
+	};
+
+	auto start = bench_clock::now();
+
+	for (size_t e = 0; e < entities; ++e)
+		spawn(e);
+
+	stats.peak(entities * entity_bytes);
+
+	for (size_t frame = 0; frame < frames; ++frame) {
+		for (size_t i = 0; i < entities / 2; ++i) {
+			size_t e = rng() % entities;
+			kill(e);
+			spawn(e);
+		}
+
+		stats.peak(entities * entity_bytes);
+	}
+
+	for (size_t e = 0; e < entities; ++e)
+		kill(e);
+
+	stats.seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// the churn loop on several threads at once, every thread with blocks of its
+// own. the result is the throughput summed over all threads
+static double threaded_churn(const allocator_api& api, size_t threads, size_t iterations) {
+	std::vector<std::thread> workers;
+	std::atomic<size_t> ready = 0;
+	std::atomic<bool> go = false;
+
+	for (size_t t = 0; t < threads; ++t) {
+		workers.emplace_back([&, t] {
+			std::mt19937_64 rng(t + 1);
+			std::vector<void*> live(4096, nullptr);
+
+			++ready;
+			while (!go)
+				std::this_thread::yield();
+
+			for (size_t i = 0; i < iterations; ++i) {
+				void*& slot = live[rng() % live.size()];
+
+				if (slot)
+					api.free(slot);
+
+				slot = api.alloc(random_size(rng, 1024));
+				*(char*)slot = 5;
+			}
+
+			for (void* p : live)
+				api.free(p);
+		});
+	}
+
+	while (ready < threads)
+		std::this_thread::yield();
+
+	auto start = bench_clock::now();
+	go = true;
+
+	for (std::thread& worker : workers)
+		worker.join();
+
+	double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+	return (double)(threads * iterations * 2) / seconds;
+}
+
+// how the general heap scales with threads as a single shard against one
+// shard per core, the system malloc for reference
+static void thread_scaling() {
+	constexpr size_t iterations = 1000000;
+	const allocator_api& vmm = allocators[0];
+	const allocator_api& system = allocators[2];
+
+	printf("\n%-8s %16s %16s %16s\n", "threads", "vmm 1 shard", "vmm sharded", "system");
+
+	for (size_t threads = 1; threads <= 32; threads *= 2) {
+		vmm_set_heap_shards(1, VMM_HEAP_SHARDS_ROUND_ROBIN);
+		double single = threaded_churn(vmm, threads, iterations);
+
+		u32 shards = vmm_set_heap_shards(0, VMM_HEAP_SHARDS_ROUND_ROBIN);
+		double sharded = threaded_churn(vmm, threads, iterations);
+
+		double reference = threaded_churn(system, threads, iterations);
+
+		printf("%-8zu %12.0f ops/s %12.0f ops/s %12.0f ops/s  (%u shards)\n", threads, single, sharded, reference, shards);
+		vmm_purge();
+	}
+}
+
+// streaming: a scratch file is read front to back in 256 KiB low priority
+// chunks, kept 64 deep, while the frame thread asks for 16 KiB high priority
+// reads at random offsets one after the other. reported are the streaming
+// throughput and the latency of the high priority reads, with and without
+// the background load. the file is fresh in the page cache, so this measures
+// the engine more than the disk
+struct stream_bench {
+	static constexpr u32 chunk_size = 256 * 1024;
+	static constexpr u32 chunks_in_flight = 64;
+	static constexpr u32 urgent_size = 16 * 1024;
+
+	struct chunk_slot {
+		stream_bench* bench;
+		void* buffer;
+	};
+
+	io_file file;
+	u64 file_size = 0;
+	u64 next_offset = 0;
+	u64 streamed = 0;
+	std::vector<chunk_slot*> free_slots;
+	std::vector<u32> latencies;
+	bool urgent_done = false;
+
+	static void chunk_read(void* user, void*, i64 result) {
+		chunk_slot* slot = (chunk_slot*)user;
+		if (result > 0)
+			slot->bench->streamed += (u64)result;
+
+		slot->bench->free_slots.push_back(slot);
+	}
+
+	static void urgent_read(void* user, void*, i64) {
+		((stream_bench*)user)->urgent_done = true;
+	}
+
+	void stream_more() {
+		io_batch batch;
+
+		while (!free_slots.empty()) {
+			chunk_slot* slot = free_slots.back();
+
+			io_read read;
+			read.file = file;
+			read.offset = next_offset;
+			read.size = chunk_size;
+			read.priority = io_priority_low;
+			read.dest = slot->buffer;
+			read.callback = chunk_read;
+			read.user = slot;
+
+			if (!io_stream.add(batch, read))
+				break;
+
+			free_slots.pop_back();
+			next_offset = next_offset + chunk_size < file_size ? next_offset + chunk_size : 0;
+		}
+
+		io_stream.submit(batch);
+	}
+
+	void run(const char* backend, bool background, double seconds) {
+		arena_handle_t* frame_arena = arena_create(1024 * 1024, false);
+		std::vector<chunk_slot> slots(chunks_in_flight);
+		std::vector<char> buffers((size_t)chunks_in_flight * chunk_size);
+		std::mt19937_64 rng(11);
+
+		free_slots.clear();
+		for (u32 i = 0; i < chunks_in_flight; ++i) {
+			slots[i] = { this, &buffers[(size_t)i * chunk_size] };
+			free_slots.push_back(&slots[i]);
+		}
+
+		streamed = 0;
+		latencies.clear();
+
+		auto start = bench_clock::now();
+		auto end = start + std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(seconds));
+
+		while (bench_clock::now() < end) {
+			if (background)
+				stream_more();
+
+			arena_reset(frame_arena);
+
+			io_read read;
+			read.file = file;
+			read.offset = (rng() % (file_size / urgent_size)) * urgent_size;
+			read.size = urgent_size;
+			read.priority = io_priority_high;
+			read.arena = frame_arena;
+			read.callback = urgent_read;
+			read.user = this;
+
+			urgent_done = false;
+			auto issued = bench_clock::now();
+
+			if (!io_stream.read(read)) {
+				io_stream.poll();
+				continue;
+			}
+
+			while (!urgent_done) {
+				if (!io_stream.poll())
+					std::this_thread::yield();
+			}
+
+			latencies.push_back((u32)std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - issued).count());
+		}
+
+		while (io_stream.outstanding_reads())
+			io_stream.poll();
+
+		double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+		std::sort(latencies.begin(), latencies.end());
+
+		auto percentile = [&](double p) {
+			return latencies.empty() ? 0u : latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+		};
+
+		printf("%-8s %-10s %10.1f MB/s  high priority %8zu reads  p50 %7.1f us  p99 %8.1f us  max %9.1f us\n",
+			backend, background ? "streaming" : "idle", streamed / elapsed / (1024 * 1024), latencies.size(),
+			percentile(0.50) / 1e3, percentile(0.99) / 1e3, latencies.empty() ? 0.0 : latencies.back() / 1e3);
+
+		arena_destroy(frame_arena);
+	}
+};
+
+static void streaming() {
+	const char* path = "io_stream_bench.bin";
+	constexpr size_t file_size = 256 * 1024 * 1024;
+
+	if (FILE* f = fopen(path, "wb")) {
+		std::vector<char> block(1024 * 1024, 6);
+		for (size_t written = 0; written < file_size; written += block.size())
+			fwrite(block.data(), 1, block.size(), f);
+
+		fclose(f);
+	}
+
+	stream_bench bench;
+	if (!io_open_file(path, bench.file)) {
+		printf("\nstreaming skipped, no scratch file\n");
+		return;
+	}
+
+	bench.file_size = io_file_size(bench.file);
+
+	printf("\n%-8s %-10s %15s\n", "backend", "load", "throughput");
+
+	for (bool use_uring : { true, false }) {
+		if (!io_stream.initialize(64, use_uring))
+			continue;
+
+		const char* backend = io_stream.backend() == io_backend_uring ? "io_uring" : "threads";
+
+		// where io_uring can't be set up the first round falls back to the
+		// pool, which the second one measures anyway
+		if (use_uring == (io_stream.backend() == io_backend_uring)) {
+			bench.run(backend, false, 1.0);
+			bench.run(backend, true, 2.0);
+		}
+
+		io_stream.shutdown();
+	}
+
+	io_close_file(bench.file);
+	remove(path);
+}
+
+template <typename fn_t>
+static void run(const char* workload, fn_t&& fn) {
+	for (const allocator_api& api : allocators) {
+		if (api.thread_cache)
+			htcache_enable();
+
+		run_stats stats;
+		stats.rss_base = current_rss();
+		stats.rss_peak = stats.rss_base;
+
+		fn(api, stats);
+		stats.report(workload, api.name);
+
+		if (api.thread_cache)
+			htcache_disable();
+
+		vmm_purge();
+	}
+}
+
+int main() {
+	printf("%-18s %-11s %18s\n", "workload", "allocator", "throughput");
+
+	run("churn small", [](const allocator_api& api, run_stats& stats) { churn(api, stats, 512, 16384, 4000000); });
+	run("churn mixed", [](const allocator_api& api, run_stats& stats) { churn(api, stats, 64 * 1024, 16384, 2000000); });
+	run("churn large", [](const allocator_api& api, run_stats& stats) { churn(api, stats, 1024 * 1024, 1024, 200000); });
+	run("producer/consumer", [](const allocator_api& api, run_stats& stats) { producer_consumer(api, stats, 2000000); });
+	run("realloc growth", [](const allocator_api& api, run_stats& stats) { realloc_growth(api, stats, 16, 16 * 1024 * 1024, 4); });
+	run("entity spawn 50k", [](const allocator_api& api, run_stats& stats) { entity_spawn(api, stats, 50000, 20); });
+
+	thread_scaling();
+	streaming();
+
+	printf("\npeak rss %.1f MB\n", peak_rss() / (1024.0 * 1024.0));
+
+	// only filled in when vmm was built with PLTF_LOCK_PROFILE
+	vmm_lock_profile locks[16];
+	size_t lock_count = vmm_get_lock_profile(locks, 16);
+
+	for (size_t i = 0; i < lock_count; ++i) {
+		const vmm_lock_profile& l = locks[i];
+		printf("%-10s %12zu acquires  %10zu contended  wait %9.3f ms (max %8.1f us)  hold %9.3f ms (max %8.1f us)\n",
+			l.name, l.acquires, l.contended, l.wait_ns / 1e6, l.max_wait_ns / 1e3, l.hold_ns / 1e6, l.max_hold_ns / 1e3);
+	}
+	return 0;
+}
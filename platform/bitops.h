@@ -0,0 +1,25 @@
+#pragma once
+
+#ifdef PLATFORM_WINDOWS
+
+#include <intrin.h>
+
+FORCE_INLINE u32 bit_scan_forward(u64 mask) {
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return index;
+}
+
+FORCE_INLINE u32 bit_scan_reverse(u64 mask) {
+    unsigned long index;
+    _BitScanReverse64(&index, mask);
+    return index;
+}
+
+#elif defined(PLATFORM_LINUX)
+
+FORCE_INLINE u32 bit_scan_forward(u64 mask) { return (u32)__builtin_ctzll(mask); }
+
+FORCE_INLINE u32 bit_scan_reverse(u64 mask) { return 63 - (u32)__builtin_clzll(mask); }
+
+#endif
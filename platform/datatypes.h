@@ -34,4 +34,36 @@ typedef wchar_t             wchar;
 #define ALIGN(x)            __declspec(align(x))
 #define API_EXPORT           __declspec(dllexport)
 #define API_IMPORT           __declspec(dllimport)
+
+#elif defined(PLATFORM_LINUX)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef int8_t              i8;
+typedef int16_t             i16;
+typedef int32_t             i32;
+typedef int64_t             i64;
+
+typedef uint8_t             u8;
+typedef uint16_t            u16;
+typedef uint32_t            u32;
+typedef uint64_t            u64;
+
+typedef float               f32;
+typedef double              f64;
+
+typedef uint32_t            ul32;
+typedef unsigned long long  ul64;
+typedef uint32_t            dw32;
+typedef uint64_t            dw64;
+
+typedef wchar_t             wchar;
+
+#define FORCE_INLINE        inline __attribute__((always_inline))
+#define NO_INLINE           __attribute__((noinline))
+#define ALIGN(x)            __attribute__((aligned(x)))
+#define API_EXPORT           __attribute__((visibility("default")))
+#define API_IMPORT
 #endif 
@@ -1,6 +1,154 @@
 #pragma once
 
+// read only file mappings for assets that are used in place. io_map_file maps
+// the whole file as one page aligned view, the pages come straight from the
+// os file cache so nothing is copied and a file mapped twice, or by two
+// processes, is in memory once. the file handle is closed right away, the
+// view keeps the file open until io_unmap.
+//
+// pages fault in on first touch, io_prefetch starts reading a range in the
+// background ahead of that. the access hint tunes the os read ahead for the
+// whole view
+enum io_access_hint : u32 {
+    io_access_normal,
+    io_access_sequential,
+    io_access_random
+};
+
+struct io_mapped_file {
+    const void* data = nullptr;
+    size_t size = 0;
+};
+
+// null when the range isn't inside the view
+inline const void* io_view(const io_mapped_file& file, size_t offset, size_t size) {
+    if (offset > file.size || size > file.size - offset)
+        return nullptr;
+
+    return static_cast<const char*>(file.data) + offset;
+}
+
 #ifdef PLATFORM_WINDOWS
 #include <iostream>
+#include <Windows.h>
+
+// an empty file maps as an empty view, windows can't map zero bytes
+inline bool io_map_file(const char* path, io_mapped_file& file, io_access_hint hint = io_access_normal) {
+    DWORD flags = FILE_ATTRIBUTE_NORMAL;
+
+    if (hint == io_access_sequential)
+        flags |= FILE_FLAG_SEQUENTIAL_SCAN;
+    else if (hint == io_access_random)
+        flags |= FILE_FLAG_RANDOM_ACCESS;
+
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size)) {
+        CloseHandle(handle);
+        return false;
+    }
+
+    file = io_mapped_file{};
+
+    if (!size.QuadPart) {
+        CloseHandle(handle);
+        return true;
+    }
+
+    HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(handle);
+
+    if (!mapping)
+        return false;
+
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+
+    if (!view)
+        return false;
+
+    file.data = view;
+    file.size = (size_t)size.QuadPart;
+    return true;
+}
+
+inline void io_unmap(io_mapped_file& file) {
+    if (file.data)
+        UnmapViewOfFile(file.data);
+
+    file = io_mapped_file{};
+}
+
+inline void io_prefetch(const io_mapped_file& file, size_t offset, size_t size) {
+    const void* range = io_view(file, offset, size);
+    if (!range || !size)
+        return;
+
+    WIN32_MEMORY_RANGE_ENTRY entry = { const_cast<void*>(range), size };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &entry, 0);
+}
+
+#elif defined(PLATFORM_LINUX)
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+inline bool io_map_file(const char* path, io_mapped_file& file, io_access_hint hint = io_access_normal) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+
+    file = io_mapped_file{};
+
+    if (!info.st_size) {
+        close(fd);
+        return true;
+    }
+
+    void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (view == MAP_FAILED)
+        return false;
+
+    if (hint == io_access_sequential)
+        madvise(view, (size_t)info.st_size, MADV_SEQUENTIAL);
+    else if (hint == io_access_random)
+        madvise(view, (size_t)info.st_size, MADV_RANDOM);
+
+    file.data = view;
+    file.size = (size_t)info.st_size;
+    return true;
+}
+
+inline void io_unmap(io_mapped_file& file) {
+    if (file.data)
+        munmap(const_cast<void*>(file.data), file.size);
+
+    file = io_mapped_file{};
+}
+
+// madvise wants a page aligned start, the range is widened down to one
+inline void io_prefetch(const io_mapped_file& file, size_t offset, size_t size) {
+    const void* range = io_view(file, offset, size);
+    if (!range || !size)
+        return;
+
+    size_t page_mask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+    size_t start = reinterpret_cast<size_t>(range) & ~page_mask;
+
+    madvise(reinterpret_cast<void*>(start), reinterpret_cast<size_t>(range) + size - start, MADV_WILLNEED);
+}
 
-#endif
\ No newline at end of file
+#endif
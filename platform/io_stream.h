@@ -0,0 +1,831 @@
+#pragma once
+#include "datatypes.h"
+#include "mtx.h"
+#include "thread.h"
+#include "vmm.h"
+#include "queue.h"
+#include <atomic>
+#include <new>
+#include <thread>
+
+#ifdef PLATFORM_WINDOWS
+#include <Windows.h>
+#elif defined(PLATFORM_LINUX)
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// io_uring goes through the raw system calls, the kernel header is all it
+// needs. without it the reads always go through the thread pool
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#define IO_STREAM_URING
+#endif
+#endif
+
+// asynchronous file reads for streaming. any thread submits reads, they go
+// into one lock free submission queue, are sorted by priority and started
+// oldest first within a priority while fewer than queue_depth are in flight.
+// finished reads go into a completion queue whose callbacks run on the
+// thread that polls it, usually the frame thread once per frame, so nothing
+// the callbacks touch needs a lock.
+//
+// on linux the reads go to the kernel through io_uring, one thread fills the
+// submission ring and reaps the completions with a single system call per
+// round. everywhere else, and where io_uring can't be set up, a small pool of
+// threads does blocking positioned reads instead.
+//
+// a quarter of the depth is kept free for high priority reads: normal and low
+// ones only start while the rest of it isn't taken, so a high priority read
+// waits behind no more than that however much background streaming is queued.
+//
+// data is read straight into its destination. a read without one gets it
+// from an arena on the submitting thread, the arena has to stay alive until
+// the read is polled
+enum io_priority : u32 {
+    io_priority_high,
+    io_priority_normal,
+    io_priority_low,
+    io_priority_count
+};
+
+enum io_backend : u32 {
+    io_backend_none,
+    io_backend_uring,
+    io_backend_threads
+};
+
+// the result of a read that was still queued at shutdown
+constexpr i64 io_cancelled = -(1ll << 62);
+
+// result is the byte count read, less than asked for at the end of the file,
+// or the negated system error code
+typedef void (*io_read_fn)(void* user, void* data, i64 result);
+
+// an open file handle or file descriptor
+struct io_file {
+    intptr_t handle = -1;
+};
+
+struct io_read {
+    io_file file;
+    u64 offset = 0;
+    u32 size = 0;
+    io_priority priority = io_priority_normal;
+
+    // where the data goes, null allocates it from arena
+    void* dest = nullptr;
+    arena_handle_t* arena = nullptr;
+
+    io_read_fn callback = nullptr;
+    void* user = nullptr;
+};
+
+// node comes first, requests are found from the queue nodes by a cast
+struct io_request {
+    pltf_mpsc_node node;
+    io_request* next;
+    intptr_t handle;
+    u64 offset;
+    void* dest;
+    u32 size;
+    u32 done;
+    io_priority priority;
+    io_read_fn callback;
+    void* user;
+    i64 result;
+};
+
+// reads gathered on one thread and submitted together, with one push and at
+// most one wake
+struct io_batch {
+    io_request* first = nullptr;
+    io_request* last = nullptr;
+    u32 count = 0;
+};
+
+#ifdef PLATFORM_WINDOWS
+
+// opened for overlapped io, reads on a synchronous handle are serialized by
+// the io manager and would get the pool no parallelism on one file
+inline bool io_open_file(const char* path, io_file& file) {
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    file.handle = reinterpret_cast<intptr_t>(handle);
+    return true;
+}
+
+inline void io_close_file(io_file& file) {
+    if (file.handle != -1)
+        CloseHandle(reinterpret_cast<HANDLE>(file.handle));
+
+    file = io_file{};
+}
+
+inline u64 io_file_size(io_file file) {
+    LARGE_INTEGER size;
+    return GetFileSizeEx(reinterpret_cast<HANDLE>(file.handle), &size) ? (u64)size.QuadPart : 0;
+}
+
+// the event a thread waits on for its own reads, closed when the thread exits
+struct io_read_event {
+    HANDLE handle = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    ~io_read_event() { if (handle) CloseHandle(handle); }
+};
+
+// an overlapped read at the offset that the calling thread waits for on an
+// event of its own, the handle is shared by every thread reading the file
+// so it can't be waited on itself. overlapped handles have no file pointer
+inline i64 io_read_at(intptr_t handle, void* dest, u32 size, u64 offset) {
+    static thread_local io_read_event read_event;
+
+    HANDLE event = read_event.handle;
+    if (!event)
+        return -(i64)GetLastError();
+
+    HANDLE file = reinterpret_cast<HANDLE>(handle);
+    u32 total = 0;
+
+    while (total < size) {
+        OVERLAPPED position = {};
+        position.Offset = (DWORD)(offset + total);
+        position.OffsetHigh = (DWORD)((offset + total) >> 32);
+        position.hEvent = event;
+
+        DWORD read = 0;
+        if (!ReadFile(file, static_cast<char*>(dest) + total, size - total, nullptr, &position) &&
+            GetLastError() != ERROR_IO_PENDING) {
+            DWORD error = GetLastError();
+            return error == ERROR_HANDLE_EOF ? (i64)total : -(i64)error;
+        }
+
+        if (!GetOverlappedResult(file, &position, &read, TRUE)) {
+            DWORD error = GetLastError();
+            return error == ERROR_HANDLE_EOF ? (i64)total : -(i64)error;
+        }
+
+        if (!read)
+            break;
+
+        total += read;
+    }
+
+    return total;
+}
+
+#elif defined(PLATFORM_LINUX)
+
+inline bool io_open_file(const char* path, io_file& file) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    file.handle = fd;
+    return true;
+}
+
+inline void io_close_file(io_file& file) {
+    if (file.handle != -1)
+        close((int)file.handle);
+
+    file = io_file{};
+}
+
+inline u64 io_file_size(io_file file) {
+    struct stat info;
+    return fstat((int)file.handle, &info) == 0 ? (u64)info.st_size : 0;
+}
+
+inline i64 io_read_at(intptr_t handle, void* dest, u32 size, u64 offset) {
+    u32 total = 0;
+
+    while (total < size) {
+        ssize_t read = pread((int)handle, static_cast<char*>(dest) + total, size - total, (off_t)(offset + total));
+
+        if (read < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -(i64)errno;
+        }
+
+        if (!read)
+            break;
+
+        total += (u32)read;
+    }
+
+    return total;
+}
+
+#endif
+
+class io_stream_t {
+public:
+    static constexpr u32 max_requests = 4096;
+    static constexpr u32 max_queue_depth = 256;
+    static constexpr u32 max_threads = 16;
+
+    ~io_stream_t() { shutdown(); }
+
+    // queue_depth is the most reads in flight at once, the thread pool runs
+    // one thread per read up to max_threads. false when no backend could be
+    // started
+    bool initialize(u32 queue_depth = 64, bool use_uring = true)
+    {
+        pltf_lock_guard lock(setup_lock, PLTF_LOCK_SITE("io_stream"));
+
+        if (active.load(std::memory_order_relaxed) != io_backend_none)
+            return true;
+
+        if (!queue_depth)
+            queue_depth = 1;
+
+        if (queue_depth > max_queue_depth)
+            queue_depth = max_queue_depth;
+
+        requests = static_cast<io_request*>(valloc(sizeof(io_request) * max_requests));
+        if (!requests)
+            return false;
+
+        for (u32 i = 0; i < max_requests; ++i)
+            free_requests.try_push(new (&requests[i]) io_request());
+
+#ifdef IO_STREAM_URING
+        if (use_uring && setup_uring(queue_depth))
+        {
+            set_depth(queue_depth);
+            threads[0] = std::thread(&io_stream_t::uring_main, this);
+            thread_count = 1;
+            active.store(io_backend_uring, std::memory_order_release);
+            return true;
+        }
+#else
+        (void)use_uring;
+#endif
+
+        u32 count = queue_depth < max_threads ? queue_depth : max_threads;
+        set_depth(count);
+
+        for (u32 i = 0; i < count; ++i)
+            threads[i] = std::thread(&io_stream_t::worker_main, this);
+
+        thread_count = count;
+        active.store(io_backend_threads, std::memory_order_release);
+        return true;
+    }
+
+    // waits for the reads in flight, finishes the queued ones as cancelled
+    // and runs every callback still outstanding. called from the polling
+    // thread
+    void shutdown()
+    {
+        pltf_lock_guard lock(setup_lock, PLTF_LOCK_SITE("io_stream"));
+
+        if (active.load(std::memory_order_relaxed) == io_backend_none)
+            return;
+
+        stopping.store(true, std::memory_order_seq_cst);
+        wake(max_threads);
+
+        for (u32 i = 0; i < thread_count; ++i)
+            threads[i].join();
+
+        thread_count = 0;
+
+#ifdef IO_STREAM_URING
+        teardown_uring();
+#endif
+
+        // a callback may still submit, that read is cancelled as well
+        do
+        {
+            while (io_request* request = next_pending(true))
+                finish(request, io_cancelled);
+
+            poll();
+        } while (outstanding.load(std::memory_order_acquire));
+
+        io_request* request;
+        while (free_requests.try_pop(request))
+            ;
+
+        vfree(requests);
+        requests = nullptr;
+
+        active.store(io_backend_none, std::memory_order_release);
+        stopping.store(false, std::memory_order_relaxed);
+    }
+
+    io_backend backend() const { return (io_backend)active.load(std::memory_order_acquire); }
+
+    // false when every request is taken or the arena is full, nothing is
+    // queued then
+    bool read(const io_read& desc)
+    {
+        io_batch batch;
+
+        if (!add(batch, desc))
+            return false;
+
+        submit(batch);
+        return true;
+    }
+
+    bool add(io_batch& batch, const io_read& desc)
+    {
+        io_request* request;
+        if (!free_requests.try_pop(request))
+            return false;
+
+        void* dest = desc.dest;
+
+        if (!dest && !(desc.arena && (dest = arena_alloc(desc.arena, desc.size, 64))))
+        {
+            free_requests.try_push(request);
+            return false;
+        }
+
+        request->next = nullptr;
+        request->handle = desc.file.handle;
+        request->offset = desc.offset;
+        request->dest = dest;
+        request->size = desc.size;
+        request->done = 0;
+        request->priority = desc.priority < io_priority_count ? desc.priority : io_priority_low;
+        request->callback = desc.callback;
+        request->user = desc.user;
+        request->result = 0;
+
+        if (batch.last)
+            batch.last->node.next.store(&request->node, std::memory_order_relaxed);
+        else
+            batch.first = request;
+
+        batch.last = request;
+        ++batch.count;
+        return true;
+    }
+
+    void submit(io_batch& batch)
+    {
+        if (!batch.count)
+            return;
+
+        outstanding.fetch_add(batch.count, std::memory_order_relaxed);
+        submissions.push_batch(&batch.first->node, &batch.last->node);
+        wake(batch.count);
+
+        batch = io_batch{};
+    }
+
+    // runs the callbacks of up to max finished reads and returns how many.
+    // one thread at a time, a callback may submit more reads
+    u32 poll(u32 max = ~0u)
+    {
+        u32 count = 0;
+
+        while (count < max)
+        {
+            pltf_mpsc_node* node = completions.pop();
+            if (!node)
+                break;
+
+            io_request* request = reinterpret_cast<io_request*>(node);
+            io_read_fn callback = request->callback;
+            void* user = request->user;
+            void* data = request->dest;
+            i64 result = request->result;
+
+            free_requests.try_push(request);
+            outstanding.fetch_sub(1, std::memory_order_release);
+
+            if (callback)
+                callback(user, data, result);
+
+            ++count;
+        }
+
+        return count;
+    }
+
+    // reads submitted whose callbacks haven't run yet
+    u32 outstanding_reads() const { return outstanding.load(std::memory_order_acquire); }
+
+private:
+    io_request* requests = nullptr;
+    pltf_mpmc_ring<io_request*, max_requests> free_requests;
+
+    pltf_mpsc_queue submissions;
+    pltf_mpsc_queue completions;
+
+    // the submissions sorted by priority. taken by the uring thread alone, by
+    // the pool threads under pending_lock
+    io_request* pending_first[io_priority_count] = {};
+    io_request* pending_last[io_priority_count] = {};
+    pltf_spin_mutex pending_lock;
+
+    u32 depth = 0;
+    u32 background_depth = 0;
+    u32 in_flight = 0;
+    u32 background_in_flight = 0;
+
+    std::atomic<u32> outstanding{ 0 };
+
+    // bumped by every submit, idle threads wait on it
+    std::atomic<u32> signal{ 0 };
+    std::atomic<u32> sleepers{ 0 };
+    std::atomic<bool> stopping{ false };
+
+    std::atomic<u32> active{ io_backend_none };
+    std::thread threads[max_threads];
+    u32 thread_count = 0;
+    pltf_spin_mutex setup_lock;
+
+    void set_depth(u32 count)
+    {
+        depth = count;
+        background_depth = count - count / 4;
+        in_flight = 0;
+        background_in_flight = 0;
+    }
+
+    // a sleeping uring thread waits in the kernel on its eventfd, pool
+    // threads on the signal word
+    void wake(u32 count)
+    {
+        signal.fetch_add(1, std::memory_order_seq_cst);
+
+        if (!sleepers.load(std::memory_order_seq_cst))
+            return;
+
+#ifdef IO_STREAM_URING
+        if (active.load(std::memory_order_acquire) == io_backend_uring)
+        {
+            if (sleepers.exchange(0, std::memory_order_seq_cst))
+            {
+                u64 value = 1;
+                (void)!write(uring.wake_fd, &value, sizeof(value));
+            }
+
+            return;
+        }
+#endif
+
+        if (count == 1)
+            pltf_wake_one(&signal);
+        else
+            pltf_wake_all(&signal);
+    }
+
+    // the oldest read of the highest priority there is. below high priority a
+    // read only starts while fewer than background_depth of those are in
+    // flight. all takes everything, for the cancel at shutdown
+    io_request* next_pending(bool all = false)
+    {
+        while (pltf_mpsc_node* node = submissions.pop())
+        {
+            io_request* request = reinterpret_cast<io_request*>(node);
+            io_priority priority = request->priority;
+
+            request->next = nullptr;
+
+            if (pending_last[priority])
+                pending_last[priority]->next = request;
+            else
+                pending_first[priority] = request;
+
+            pending_last[priority] = request;
+        }
+
+        for (u32 priority = 0; priority < io_priority_count; ++priority)
+        {
+            io_request* request = pending_first[priority];
+            if (!request)
+                continue;
+
+            if (priority != io_priority_high && !all)
+            {
+                if (background_in_flight >= background_depth)
+                    return nullptr;
+
+                ++background_in_flight;
+            }
+
+            pending_first[priority] = request->next;
+            if (!request->next)
+                pending_last[priority] = nullptr;
+
+            return request;
+        }
+
+        return nullptr;
+    }
+
+    void finish(io_request* request, i64 result)
+    {
+        request->result = result;
+        completions.push(&request->node);
+    }
+
+    void worker_main()
+    {
+        for (;;)
+        {
+            u32 seen = signal.load(std::memory_order_acquire);
+            io_request* request = nullptr;
+
+            if (!stopping.load(std::memory_order_acquire))
+            {
+                pltf_lock_guard lock(pending_lock, PLTF_LOCK_SITE("io_stream"));
+                request = next_pending();
+            }
+
+            if (request)
+            {
+                i64 result = io_read_at(request->handle, request->dest, request->size, request->offset);
+
+                if (request->priority != io_priority_high)
+                {
+                    pltf_lock_guard lock(pending_lock, PLTF_LOCK_SITE("io_stream"));
+                    --background_in_flight;
+                }
+
+                finish(request, result);
+                continue;
+            }
+
+            if (stopping.load(std::memory_order_acquire))
+                break;
+
+            park(seen);
+        }
+    }
+
+    // a submit after seen was read bumped the signal and the wait returns
+    // right away
+    void park(u32 seen)
+    {
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+
+        if (signal.load(std::memory_order_seq_cst) == seen && !stopping.load(std::memory_order_seq_cst))
+            pltf_wait_on_address(&signal, seen);
+
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+#ifdef IO_STREAM_URING
+    // the rings are shared with the kernel, head and tail are read and
+    // written with acquire and release the way liburing does
+    struct uring_t {
+        int fd = -1;
+        int wake_fd = -1;
+        u64 wake_value = 0;
+        bool wake_armed = false;
+        u32 unsubmitted = 0;
+
+        void* sq_ring = nullptr;
+        size_t sq_ring_size = 0;
+        void* cq_ring = nullptr;
+        size_t cq_ring_size = 0;
+        io_uring_sqe* sqes = nullptr;
+        size_t sqes_size = 0;
+
+        std::atomic<u32>* sq_tail = nullptr;
+        u32* sq_array = nullptr;
+        u32 sq_mask = 0;
+
+        std::atomic<u32>* cq_head = nullptr;
+        std::atomic<u32>* cq_tail = nullptr;
+        io_uring_cqe* cqes = nullptr;
+        u32 cq_mask = 0;
+    };
+
+    // the user data of the read that waits on the eventfd
+    static constexpr u64 wake_tag = 0;
+
+    uring_t uring;
+
+    // one entry more than the depth for the eventfd read. IORING_OP_READ came
+    // with the same kernel as IORING_FEAT_RW_CUR_POS, older ones use the pool
+    bool setup_uring(u32 entries)
+    {
+        io_uring_params params = {};
+        int fd = (int)syscall(__NR_io_uring_setup, entries + 1, &params);
+        if (fd < 0)
+            return false;
+
+        uring = uring_t{};
+        uring.fd = fd;
+
+        if (!(params.features & IORING_FEAT_RW_CUR_POS))
+        {
+            teardown_uring();
+            return false;
+        }
+
+        uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+        uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+        if (single_mmap)
+        {
+            size_t size = uring.sq_ring_size > uring.cq_ring_size ? uring.sq_ring_size : uring.cq_ring_size;
+            uring.sq_ring_size = size;
+            uring.cq_ring_size = size;
+        }
+
+        void* sq_ring = mmap(nullptr, uring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        uring.sq_ring = sq_ring == MAP_FAILED ? nullptr : sq_ring;
+
+        if (single_mmap)
+            uring.cq_ring = uring.sq_ring;
+        else
+        {
+            void* cq_ring = mmap(nullptr, uring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            uring.cq_ring = cq_ring == MAP_FAILED ? nullptr : cq_ring;
+        }
+
+        uring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        uring.sqes = sqes == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(sqes);
+
+        uring.wake_fd = eventfd(0, EFD_CLOEXEC);
+
+        if (!uring.sq_ring || !uring.cq_ring || !uring.sqes || uring.wake_fd < 0)
+        {
+            teardown_uring();
+            return false;
+        }
+
+        char* sq = static_cast<char*>(uring.sq_ring);
+        char* cq = static_cast<char*>(uring.cq_ring);
+
+        uring.sq_tail = reinterpret_cast<std::atomic<u32>*>(sq + params.sq_off.tail);
+        uring.sq_array = reinterpret_cast<u32*>(sq + params.sq_off.array);
+        uring.sq_mask = *reinterpret_cast<u32*>(sq + params.sq_off.ring_mask);
+
+        uring.cq_head = reinterpret_cast<std::atomic<u32>*>(cq + params.cq_off.head);
+        uring.cq_tail = reinterpret_cast<std::atomic<u32>*>(cq + params.cq_off.tail);
+        uring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        uring.cq_mask = *reinterpret_cast<u32*>(cq + params.cq_off.ring_mask);
+
+        return true;
+    }
+
+    // closing the ring cancels the eventfd read that is still waiting
+    void teardown_uring()
+    {
+        if (uring.sqes)
+            munmap(uring.sqes, uring.sqes_size);
+
+        if (uring.cq_ring && uring.cq_ring != uring.sq_ring)
+            munmap(uring.cq_ring, uring.cq_ring_size);
+
+        if (uring.sq_ring)
+            munmap(uring.sq_ring, uring.sq_ring_size);
+
+        if (uring.wake_fd >= 0)
+            close(uring.wake_fd);
+
+        if (uring.fd >= 0)
+            close(uring.fd);
+
+        uring = uring_t{};
+    }
+
+    // in flight reads never exceed the ring, a free entry is always there
+    void queue_read(int fd, void* dest, u32 size, u64 offset, u64 tag, u8 flags = 0)
+    {
+        u32 tail = uring.sq_tail->load(std::memory_order_relaxed);
+        u32 index = tail & uring.sq_mask;
+
+        io_uring_sqe* sqe = &uring.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->flags = flags;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = reinterpret_cast<u64>(dest);
+        sqe->len = size;
+        sqe->user_data = tag;
+
+        uring.sq_array[index] = index;
+        uring.sq_tail->store(tail + 1, std::memory_order_release);
+        ++uring.unsubmitted;
+    }
+
+    // a read of cached data is copied inside the enter that submits it,
+    // background reads go to the kernel's own workers instead so the thread
+    // is back for the next high priority read right away
+    void queue_request(io_request* request)
+    {
+        queue_read((int)request->handle, static_cast<char*>(request->dest) + request->done,
+            request->size - request->done, request->offset + request->done, reinterpret_cast<u64>(request),
+            request->priority == io_priority_high ? 0 : IOSQE_ASYNC);
+    }
+
+    // a short read that isn't at the end of the file goes back in for the
+    // rest
+    void reap()
+    {
+        u32 head = uring.cq_head->load(std::memory_order_relaxed);
+        u32 tail = uring.cq_tail->load(std::memory_order_acquire);
+
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe& cqe = uring.cqes[head & uring.cq_mask];
+
+            if (cqe.user_data == wake_tag)
+            {
+                uring.wake_armed = false;
+                continue;
+            }
+
+            io_request* request = reinterpret_cast<io_request*>(cqe.user_data);
+
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+            {
+                queue_request(request);
+                continue;
+            }
+
+            if (cqe.res > 0)
+            {
+                request->done += (u32)cqe.res;
+
+                if (request->done < request->size)
+                {
+                    queue_request(request);
+                    continue;
+                }
+            }
+
+            --in_flight;
+            if (request->priority != io_priority_high)
+                --background_in_flight;
+
+            finish(request, cqe.res < 0 ? (i64)cqe.res : (i64)request->done);
+        }
+
+        uring.cq_head->store(head, std::memory_order_release);
+    }
+
+    // every round reaps, starts what the depth allows and hands it all to the
+    // kernel with one enter, which also waits when there is nothing to do.
+    // the eventfd read is always armed so a submit can end that wait
+    void uring_main()
+    {
+        for (;;)
+        {
+            u32 seen = signal.load(std::memory_order_acquire);
+            bool stop = stopping.load(std::memory_order_acquire);
+
+            reap();
+
+            if (!uring.wake_armed && !stop)
+            {
+                queue_read(uring.wake_fd, &uring.wake_value, sizeof(uring.wake_value), 0, wake_tag);
+                uring.wake_armed = true;
+            }
+
+            if (!stop)
+            {
+                while (in_flight < depth)
+                {
+                    io_request* request = next_pending();
+                    if (!request)
+                        break;
+
+                    queue_request(request);
+                    ++in_flight;
+                }
+            }
+            else if (!in_flight)
+                break;
+
+            sleepers.store(1, std::memory_order_seq_cst);
+
+            bool idle = signal.load(std::memory_order_seq_cst) == seen && stop == stopping.load(std::memory_order_seq_cst);
+            u32 wait = idle && uring.cq_head->load(std::memory_order_relaxed) == uring.cq_tail->load(std::memory_order_acquire) ? 1 : 0;
+
+            int submitted = (int)syscall(__NR_io_uring_enter, uring.fd, uring.unsubmitted, wait, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+            if (submitted > 0)
+                uring.unsubmitted -= (u32)submitted;
+
+            sleepers.store(0, std::memory_order_relaxed);
+        }
+    }
+#endif
+};
+
+inline io_stream_t io_stream;
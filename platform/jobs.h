@@ -0,0 +1,611 @@
+#pragma once
+#include "datatypes.h"
+#include "mtx.h"
+#include "thread.h"
+#include "vmm.h"
+#include <atomic>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// work stealing job system. every worker has a deque of its own jobs, it runs
+// them newest first and idle workers steal the oldest ones of the others, so
+// a job that spawns more jobs keeps its children on its own core until some
+// other core runs dry. the thread that initializes the system is worker 0,
+// other long lived threads (the physics thread) can attach to get a deque of
+// their own. they run no loop, they take part while they wait on a counter.
+// threads that are neither run the jobs they start on the spot.
+//
+// a job and the callable it carries are bump allocated from the arena of the
+// worker that starts it and are never freed one by one. next_frame resets all
+// arenas at once, every worker resets its own the next time it starts a job.
+// nothing may be in flight across a next_frame. a worker whose arena is full
+// runs the jobs it starts on the spot until then
+
+typedef void (*pltf_job_fn)(void* data);
+
+struct pltf_job;
+
+// the number of started jobs that haven't finished yet. a job started with a
+// counter adds one and takes it away when it's done, wait returns once the
+// count is back at zero. jobs started with run_after are held back until
+// their dependency counter reaches zero. a counter can be used again as soon
+// as a wait on it returned
+class pltf_job_counter {
+public:
+    u32 pending() const { return count.load(std::memory_order_acquire) & pending_mask; }
+    bool done() const { return count.load(std::memory_order_acquire) == 0; }
+
+private:
+    friend class pltf_job_system_t;
+
+    // set while jobs wait on the counter, the job that takes the count to zero
+    // then starts them and clears it
+    static constexpr u32 has_waiting = 1u << 31;
+    static constexpr u32 pending_mask = has_waiting - 1;
+
+    std::atomic<u32> count{ 0 };
+    mutable pltf_spin_mutex lock;
+    pltf_job* waiting = nullptr;
+};
+
+struct pltf_job {
+    pltf_job_fn function;
+    void* data;
+    pltf_job_counter* counter;
+    pltf_job* next;
+};
+
+// chase lev deque, the fixed size variant with the fences of le et al. for
+// weak memory models. the owning worker pushes and pops at the bottom, any
+// other thread steals from the top. a full deque refuses the push
+class pltf_job_deque {
+public:
+    static constexpr i64 capacity = 4096;
+
+    bool push(pltf_job* job)
+    {
+        i64 b = bottom.load(std::memory_order_relaxed);
+        i64 t = top.load(std::memory_order_acquire);
+
+        if (b - t >= capacity)
+            return false;
+
+        slots[b & (capacity - 1)].store(job, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    pltf_job* pop()
+    {
+        i64 b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        i64 t = top.load(std::memory_order_relaxed);
+
+        if (t > b)
+        {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        pltf_job* job = slots[b & (capacity - 1)].load(std::memory_order_relaxed);
+
+        // the last job left, a thief may be taking it at the same time
+        if (t == b)
+        {
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                job = nullptr;
+
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        return job;
+    }
+
+    // null when empty or when another thread took the job first
+    pltf_job* steal()
+    {
+        i64 t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        i64 b = bottom.load(std::memory_order_acquire);
+
+        if (t >= b)
+            return nullptr;
+
+        pltf_job* job = slots[t & (capacity - 1)].load(std::memory_order_relaxed);
+
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+
+        return job;
+    }
+
+private:
+    alignas(64) std::atomic<i64> top{ 0 };
+    alignas(64) std::atomic<i64> bottom{ 0 };
+    alignas(64) std::atomic<pltf_job*> slots[capacity];
+};
+
+struct alignas(64) pltf_job_worker {
+    pltf_job_deque queue;
+    arena_handle_t* arena;
+    u32 frame;
+    u32 index;
+    u32 seed;
+};
+
+class pltf_job_system_t {
+public:
+    static constexpr u32 max_workers = 64;
+    static constexpr size_t arena_capacity = 16 * 1024 * 1024;
+
+    // empty searches an idle worker spins through before it parks
+    static constexpr u32 idle_spins = 64;
+
+    // joins the worker threads, whatever else is left goes with the process
+    ~pltf_job_system_t() { stop_threads(); }
+
+    // a count of 0 is one worker per core. worker 0 is the calling thread, the
+    // rest get a thread each. returns the count in use, which is less than
+    // asked for when a worker could not be created
+    u32 initialize(u32 worker_count = 0)
+    {
+        pltf_lock_guard lock(setup_lock, PLTF_LOCK_SITE("job_system"));
+
+        if (u32 count = worker_total.load(std::memory_order_relaxed))
+            return count;
+
+        if (!worker_count)
+            worker_count = pltf_cpu_count();
+
+        if (worker_count > max_workers)
+            worker_count = max_workers;
+
+        u32 current = generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+
+        pltf_job_worker* main = add_worker();
+        if (!main)
+            return 0;
+
+        local_worker = main;
+        local_generation = current;
+
+        for (u32 i = 1; i < worker_count; ++i)
+        {
+            pltf_job_worker* worker = add_worker();
+            if (!worker)
+                break;
+
+            threads[i] = std::thread(&pltf_job_system_t::worker_main, this, worker, current);
+        }
+
+        return worker_total.load(std::memory_order_relaxed);
+    }
+
+    // stops and joins the workers and frees their arenas. jobs still queued
+    // are dropped, attached threads must not use the system past this
+    void shutdown()
+    {
+        pltf_lock_guard lock(setup_lock, PLTF_LOCK_SITE("job_system"));
+
+        stop_threads();
+
+        u32 count = worker_total.load(std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_acq_rel);
+        worker_total.store(0, std::memory_order_release);
+
+        for (u32 i = 0; i < count; ++i)
+        {
+            pltf_job_worker* worker = workers[i].exchange(nullptr, std::memory_order_acq_rel);
+
+            arena_destroy(worker->arena);
+            worker->~pltf_job_worker();
+            vfree(worker);
+        }
+
+        stopping.store(false, std::memory_order_relaxed);
+    }
+
+    // gives the calling thread a deque and an arena of its own. slots are
+    // never handed back, meant for threads that live as long as the system
+    bool attach()
+    {
+        if (local())
+            return true;
+
+        pltf_lock_guard lock(setup_lock, PLTF_LOCK_SITE("job_system"));
+
+        if (!worker_total.load(std::memory_order_relaxed))
+            return false;
+
+        pltf_job_worker* worker = add_worker();
+        if (!worker)
+            return false;
+
+        local_worker = worker;
+        local_generation = generation.load(std::memory_order_relaxed);
+        return true;
+    }
+
+    void run(pltf_job_fn function, void* data, pltf_job_counter* counter = nullptr)
+    {
+        pltf_job_worker* worker = local();
+        pltf_job* job = worker ? new_job(worker, function, data, counter) : nullptr;
+
+        if (!job)
+        {
+            function(data);
+            return;
+        }
+
+        if (counter)
+            counter->count.fetch_add(1, std::memory_order_relaxed);
+
+        submit(worker, job);
+    }
+
+    // the callable is copied into the arena and destroyed once it ran
+    template <typename fn_t>
+    void run(fn_t&& fn, pltf_job_counter* counter = nullptr)
+    {
+        using callable_t = std::decay_t<fn_t>;
+
+        void* mem = allocate(sizeof(callable_t), alignof(callable_t));
+        if (!mem)
+        {
+            fn();
+            return;
+        }
+
+        run(&invoke<callable_t>, new (mem) callable_t(std::forward<fn_t>(fn)), counter);
+    }
+
+    // starts the job once dependency has no jobs pending. a thread without a
+    // deque waits for the dependency and then runs it
+    void run_after(pltf_job_counter& dependency, pltf_job_fn function, void* data, pltf_job_counter* counter = nullptr)
+    {
+        pltf_job_worker* worker = local();
+        pltf_job* job = worker ? new_job(worker, function, data, counter) : nullptr;
+
+        if (!job)
+        {
+            wait(dependency);
+            function(data);
+            return;
+        }
+
+        if (counter)
+            counter->count.fetch_add(1, std::memory_order_relaxed);
+
+        if (!defer(dependency, job))
+            submit(worker, job);
+    }
+
+    template <typename fn_t>
+    void run_after(pltf_job_counter& dependency, fn_t&& fn, pltf_job_counter* counter = nullptr)
+    {
+        using callable_t = std::decay_t<fn_t>;
+
+        void* mem = allocate(sizeof(callable_t), alignof(callable_t));
+        if (!mem)
+        {
+            wait(dependency);
+            fn();
+            return;
+        }
+
+        run_after(dependency, &invoke<callable_t>, new (mem) callable_t(std::forward<fn_t>(fn)), counter);
+    }
+
+    // runs other jobs, its own first, until the counter reaches zero
+    void wait(const pltf_job_counter& counter)
+    {
+        pltf_job_worker* worker = local();
+
+        for (u32 idle = 0; !counter.done();)
+        {
+            if (pltf_job* job = find_job(worker))
+            {
+                execute(job);
+                idle = 0;
+                continue;
+            }
+
+            if (++idle < idle_spins)
+                pltf_cpu_relax();
+            else
+                pltf_thread_yield();
+        }
+
+        // the completion that cleared has_waiting may still hold the lock
+        counter.lock.lock_exclusive();
+        counter.lock.unlock_exclusive();
+    }
+
+    // calls fn(begin, end) for runs of batch indices out of [0, count) in
+    // parallel and returns once all of them are done. a batch of 0 makes
+    // about four runs per worker
+    template <typename fn_t>
+    void parallel_for(u32 count, u32 batch, fn_t&& fn)
+    {
+        if (!batch)
+        {
+            u32 runs = worker_count() * 4;
+            batch = runs ? (count + runs - 1) / runs : count;
+            batch = batch ? batch : 1;
+        }
+
+        pltf_job_counter counter;
+
+        for (u32 begin = 0; begin < count; begin += batch)
+        {
+            u32 end = count - begin > batch ? begin + batch : count;
+            run([&fn, begin, end] { fn(begin, end); }, &counter);
+        }
+
+        wait(counter);
+    }
+
+    // scratch memory from the calling worker's arena that lives until the
+    // next frame, null on threads without an arena or once it is full
+    void* allocate(size_t size, size_t align = 16)
+    {
+        pltf_job_worker* worker = local();
+        return worker ? allocate(worker, size, align) : nullptr;
+    }
+
+    // only between frames, with every job of the last one finished
+    void next_frame() { frame.fetch_add(1, std::memory_order_release); }
+
+    u32 worker_count() const { return worker_total.load(std::memory_order_acquire); }
+
+    // the calling thread's worker index, ~0u for threads without one
+    u32 worker_index() const
+    {
+        pltf_job_worker* worker = local();
+        return worker ? worker->index : ~0u;
+    }
+
+private:
+    std::atomic<pltf_job_worker*> workers[max_workers] = {};
+    std::atomic<u32> worker_total{ 0 };
+    std::thread threads[max_workers];
+
+    // bumped by every submit, idle workers park on it
+    std::atomic<u32> signal{ 0 };
+    std::atomic<u32> sleepers{ 0 };
+    std::atomic<bool> stopping{ false };
+
+    std::atomic<u32> frame{ 0 };
+
+    // bumped by initialize and shutdown so a thread's worker from before is
+    // never used again
+    std::atomic<u32> generation{ 0 };
+    pltf_spin_mutex setup_lock;
+
+    static inline thread_local pltf_job_worker* local_worker = nullptr;
+    static inline thread_local u32 local_generation = 0;
+
+    FORCE_INLINE pltf_job_worker* local() const
+    {
+        return local_generation == generation.load(std::memory_order_acquire) ? local_worker : nullptr;
+    }
+
+    template <typename callable_t>
+    static void invoke(void* data)
+    {
+        callable_t* callable = static_cast<callable_t*>(data);
+        (*callable)();
+        callable->~callable_t();
+    }
+
+    pltf_job_worker* add_worker()
+    {
+        u32 index = worker_total.load(std::memory_order_relaxed);
+        if (index == max_workers)
+            return nullptr;
+
+        void* mem = valloc(sizeof(pltf_job_worker));
+        if (!mem)
+            return nullptr;
+
+        pltf_job_worker* worker = new (mem) pltf_job_worker();
+        worker->arena = arena_create(arena_capacity, false);
+
+        if (!worker->arena)
+        {
+            worker->~pltf_job_worker();
+            vfree(mem);
+            return nullptr;
+        }
+
+        worker->frame = frame.load(std::memory_order_relaxed);
+        worker->index = index;
+        worker->seed = index * 2654435761u + 1;
+
+        workers[index].store(worker, std::memory_order_release);
+        worker_total.store(index + 1, std::memory_order_release);
+        return worker;
+    }
+
+    void* allocate(pltf_job_worker* worker, size_t size, size_t align)
+    {
+        u32 current = frame.load(std::memory_order_acquire);
+
+        if (worker->frame != current)
+        {
+            arena_reset(worker->arena);
+            worker->frame = current;
+        }
+
+        return arena_alloc(worker->arena, size, align);
+    }
+
+    pltf_job* new_job(pltf_job_worker* worker, pltf_job_fn function, void* data, pltf_job_counter* counter)
+    {
+        void* mem = allocate(worker, sizeof(pltf_job), alignof(pltf_job));
+        return mem ? new (mem) pltf_job{ function, data, counter, nullptr } : nullptr;
+    }
+
+    // a full deque runs the job right away
+    void submit(pltf_job_worker* worker, pltf_job* job)
+    {
+        if (!worker || !worker->queue.push(job))
+        {
+            execute(job);
+            return;
+        }
+
+        signal.fetch_add(1, std::memory_order_seq_cst);
+
+        if (sleepers.load(std::memory_order_seq_cst))
+            pltf_wake_one(&signal);
+    }
+
+    void execute(pltf_job* job)
+    {
+        job->function(job->data);
+
+        if (job->counter)
+            complete(job->counter);
+    }
+
+    // the bit is cleared under the lock, a defer in between would otherwise
+    // queue its job behind a bit that is about to go away. a wait that sees
+    // the count at zero takes the lock once before it returns, so the unlock
+    // here is the last touch of a counter that may be gone right after
+    void complete(pltf_job_counter* counter)
+    {
+        if (counter->count.fetch_sub(1, std::memory_order_acq_rel) != (pltf_job_counter::has_waiting | 1))
+            return;
+
+        counter->lock.lock_exclusive();
+        pltf_job* job = counter->waiting;
+        counter->waiting = nullptr;
+        counter->count.fetch_and(~pltf_job_counter::has_waiting, std::memory_order_release);
+        counter->lock.unlock_exclusive();
+
+        pltf_job_worker* worker = local();
+
+        while (job)
+        {
+            pltf_job* next = job->next;
+            submit(worker, job);
+            job = next;
+        }
+    }
+
+    // false when the dependency is already done and the job can start now
+    bool defer(pltf_job_counter& dependency, pltf_job* job)
+    {
+        pltf_lock_guard lock(dependency.lock, PLTF_LOCK_SITE("job_counter"));
+        u32 current = dependency.count.load(std::memory_order_relaxed);
+
+        do
+        {
+            if (!(current & pltf_job_counter::pending_mask))
+                return false;
+        } while (!dependency.count.compare_exchange_weak(current, current | pltf_job_counter::has_waiting,
+            std::memory_order_acq_rel, std::memory_order_relaxed));
+
+        job->next = dependency.waiting;
+        dependency.waiting = job;
+        return true;
+    }
+
+    // own jobs first, then one steal attempt from every other worker starting
+    // at a random one
+    pltf_job* find_job(pltf_job_worker* worker)
+    {
+        if (worker)
+        {
+            if (pltf_job* job = worker->queue.pop())
+                return job;
+        }
+
+        u32 count = worker_total.load(std::memory_order_acquire);
+        if (!count)
+            return nullptr;
+
+        u32 start;
+
+        if (worker)
+        {
+            worker->seed ^= worker->seed << 13;
+            worker->seed ^= worker->seed >> 17;
+            worker->seed ^= worker->seed << 5;
+            start = worker->seed;
+        }
+        else
+            start = (u32)pltf_thread_id();
+
+        for (u32 i = 0; i < count; ++i)
+        {
+            pltf_job_worker* victim = workers[(start + i) % count].load(std::memory_order_acquire);
+
+            if (!victim || victim == worker)
+                continue;
+
+            if (pltf_job* job = victim->queue.steal())
+                return job;
+        }
+
+        return nullptr;
+    }
+
+    void worker_main(pltf_job_worker* worker, u32 current)
+    {
+        local_worker = worker;
+        local_generation = current;
+
+        for (u32 idle = 0; !stopping.load(std::memory_order_acquire);)
+        {
+            u32 seen = signal.load(std::memory_order_acquire);
+
+            if (pltf_job* job = find_job(worker))
+            {
+                execute(job);
+                idle = 0;
+                continue;
+            }
+
+            if (++idle < idle_spins)
+            {
+                pltf_cpu_relax();
+                continue;
+            }
+
+            park(seen);
+            idle = 0;
+        }
+    }
+
+    // a submit after seen was read bumped the signal, the wait then returns
+    // right away. the sleeper count tells submits whether to wake anyone
+    void park(u32 seen)
+    {
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+
+        if (signal.load(std::memory_order_seq_cst) == seen && !stopping.load(std::memory_order_seq_cst))
+            pltf_wait_on_address(&signal, seen);
+
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void stop_threads()
+    {
+        stopping.store(true, std::memory_order_seq_cst);
+        signal.fetch_add(1, std::memory_order_seq_cst);
+        pltf_wake_all(&signal);
+
+        for (std::thread& thread : threads)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+};
+
+inline pltf_job_system_t pltf_jobs;
@@ -0,0 +1,225 @@
+#pragma once
+
+// lock profiling, compiled in only when PLTF_LOCK_PROFILE is defined. every
+// guard that is given a lock name then counts into a site shared by all locks
+// of that name: acquisitions, how many of them found the lock held, the total
+// and longest wait of those and the total and longest time the lock was held.
+// counters are relaxed atomics in a fixed table, they can be read or reset at
+// any time while the locks are in use. call sites pass PLTF_LOCK_SITE(name)
+// so the site is looked up once. without PLTF_LOCK_PROFILE the guards take
+// the name and ignore it, nothing of this file is compiled
+#ifdef PLTF_LOCK_PROFILE
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+struct pltf_lock_profile_entry {
+    const char* name;
+    u64 acquires;
+    u64 contended;
+    u64 wait_ns;
+    u64 max_wait_ns;
+    u64 hold_ns;
+    u64 max_hold_ns;
+};
+
+FORCE_INLINE u64 pltf_lock_profile_now()
+{
+    using namespace std::chrono;
+    return (u64)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+class alignas(64) pltf_lock_site {
+public:
+    constexpr pltf_lock_site(const char* site_name = nullptr) : name(site_name) {}
+
+    FORCE_INLINE void count_acquire(bool was_contended, u64 wait)
+    {
+        acquires.fetch_add(1, std::memory_order_relaxed);
+
+        if (!was_contended)
+            return;
+
+        contended.fetch_add(1, std::memory_order_relaxed);
+        wait_ns.fetch_add(wait, std::memory_order_relaxed);
+        raise(max_wait_ns, wait);
+    }
+
+    FORCE_INLINE void count_hold(u64 hold)
+    {
+        hold_ns.fetch_add(hold, std::memory_order_relaxed);
+        raise(max_hold_ns, hold);
+    }
+
+    void read(pltf_lock_profile_entry& entry) const
+    {
+        entry.name = name.load(std::memory_order_acquire);
+        entry.acquires = acquires.load(std::memory_order_relaxed);
+        entry.contended = contended.load(std::memory_order_relaxed);
+        entry.wait_ns = wait_ns.load(std::memory_order_relaxed);
+        entry.max_wait_ns = max_wait_ns.load(std::memory_order_relaxed);
+        entry.hold_ns = hold_ns.load(std::memory_order_relaxed);
+        entry.max_hold_ns = max_hold_ns.load(std::memory_order_relaxed);
+    }
+
+    void reset()
+    {
+        acquires.store(0, std::memory_order_relaxed);
+        contended.store(0, std::memory_order_relaxed);
+        wait_ns.store(0, std::memory_order_relaxed);
+        max_wait_ns.store(0, std::memory_order_relaxed);
+        hold_ns.store(0, std::memory_order_relaxed);
+        max_hold_ns.store(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<const char*> name;
+
+private:
+    std::atomic<u64> acquires{ 0 };
+    std::atomic<u64> contended{ 0 };
+    std::atomic<u64> wait_ns{ 0 };
+    std::atomic<u64> max_wait_ns{ 0 };
+    std::atomic<u64> hold_ns{ 0 };
+    std::atomic<u64> max_hold_ns{ 0 };
+
+    static void raise(std::atomic<u64>& max, u64 value)
+    {
+        u64 current = max.load(std::memory_order_relaxed);
+        while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed));
+    }
+};
+
+// sites are found by hashing the name into an open addressed table, a name
+// claims its slot on first use and keeps it. names past max_sites all count
+// into one shared "(other)" site. the name strings must outlive the profiler,
+// in practice they are literals
+class pltf_lock_profiler_t {
+public:
+    static constexpr u32 max_sites = 256;
+
+    pltf_lock_site* site(const char* name)
+    {
+        if (!name)
+            name = "(unnamed)";
+
+        u32 hash = 2166136261u;
+        for (const char* c = name; *c; ++c)
+            hash = (hash ^ (u8)*c) * 16777619u;
+
+        for (u32 i = 0; i < max_sites; ++i)
+        {
+            pltf_lock_site& slot = sites[(hash + i) & (max_sites - 1)];
+            const char* claimed = slot.name.load(std::memory_order_acquire);
+
+            if (!claimed && slot.name.compare_exchange_strong(claimed, name, std::memory_order_acq_rel, std::memory_order_acquire))
+                return &slot;
+
+            if (claimed == name || !strcmp(claimed, name))
+                return &slot;
+        }
+
+        return &other;
+    }
+
+    // copies up to max sites that were used at least once, returns how many
+    u32 snapshot(pltf_lock_profile_entry* entries, u32 max) const
+    {
+        u32 count = 0;
+
+        for (u32 i = 0; i < max_sites + 1 && count < max; ++i)
+        {
+            const pltf_lock_site& slot = i < max_sites ? sites[i] : other;
+
+            if (!slot.name.load(std::memory_order_acquire))
+                continue;
+
+            slot.read(entries[count]);
+
+            if (entries[count].acquires)
+                ++count;
+        }
+
+        return count;
+    }
+
+    void reset()
+    {
+        for (pltf_lock_site& slot : sites)
+            slot.reset();
+
+        other.reset();
+    }
+
+    // one line per lock, the longest total wait first
+    void dump(FILE* out) const
+    {
+        pltf_lock_profile_entry entries[max_sites + 1];
+        u32 count = snapshot(entries, max_sites + 1);
+
+        std::sort(entries, entries + count, [](const pltf_lock_profile_entry& a, const pltf_lock_profile_entry& b) {
+            return a.wait_ns > b.wait_ns;
+        });
+
+        fprintf(out, "%-24s %12s %10s %7s %12s %11s %12s %11s\n",
+            "lock", "acquires", "contended", "%", "wait ms", "max wait us", "hold ms", "max hold us");
+
+        for (u32 i = 0; i < count; ++i)
+        {
+            const pltf_lock_profile_entry& e = entries[i];
+
+            fprintf(out, "%-24s %12llu %10llu %6.2f%% %12.3f %11.1f %12.3f %11.1f\n",
+                e.name, (unsigned long long)e.acquires, (unsigned long long)e.contended,
+                100.0 * e.contended / e.acquires,
+                e.wait_ns / 1e6, e.max_wait_ns / 1e3, e.hold_ns / 1e6, e.max_hold_ns / 1e3);
+        }
+    }
+
+private:
+    pltf_lock_site sites[max_sites];
+    pltf_lock_site other{ "(other)" };
+};
+
+inline pltf_lock_profiler_t pltf_lock_profiler;
+
+// the part of a guard that times one acquisition. the hold time is taken
+// before the unlock so it doesn't include waking a waiter
+class pltf_lock_probe {
+public:
+    template <typename try_lock_fn, typename lock_fn>
+    FORCE_INLINE void acquire(pltf_lock_site* lock_site, try_lock_fn&& try_lock, lock_fn&& lock)
+    {
+        site = lock_site;
+
+        u64 start = pltf_lock_profile_now();
+        bool contended = !try_lock();
+
+        if (contended)
+            lock();
+
+        acquired = pltf_lock_profile_now();
+        site->count_acquire(contended, acquired - start);
+    }
+
+    FORCE_INLINE void release()
+    {
+        site->count_hold(pltf_lock_profile_now() - acquired);
+    }
+
+private:
+    pltf_lock_site* site;
+    u64 acquired;
+};
+
+// resolves a lock name to its site once per call site. guards take the site
+// in place of the name, so the hot locks don't hash the name on every
+// acquisition. without profiling it is just the name
+#define PLTF_LOCK_SITE(name) ([]() -> pltf_lock_site* { static pltf_lock_site* const site = pltf_lock_profiler.site(name); return site; }())
+
+#else
+
+#define PLTF_LOCK_SITE(name) (name)
+
+#endif
@@ -1,20 +1,119 @@
 #pragma once
 
+// transparent huge page size on x86-64, regions aligned to it can be backed by huge pages
+constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+// no numa node preference, the os places pages wherever it likes
+constexpr u32 any_numa_node = ~0u;
 
 #ifdef PLATFORM_WINDOWS
 
 #include <Windows.h>
 
-void* virtual_alloc_commit(void* address, size_t size) {
+// windows takes the preferred node with every commit
+inline void* virtual_alloc_commit(void* address, size_t size, u32 node = any_numa_node) {
+    if (node != any_numa_node)
+        return VirtualAllocExNuma(GetCurrentProcess(), address, size, MEM_COMMIT, PAGE_READWRITE, node);
+
     return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE);
 }
 
-void* virtual_alloc_reserve(void* address, size_t size) {
+// large pages can't be committed inside an existing reservation on windows, plain commit
+inline void* virtual_alloc_commit_huge(void* address, size_t size, u32 node = any_numa_node) {
+    return virtual_alloc_commit(address, size, node);
+}
+
+// nothing to bind ahead of time, the node goes to every commit instead
+inline bool virtual_alloc_bind_node(void* address, size_t size, u32 node) { return true; }
+
+inline void* virtual_alloc_reserve(void* address, size_t size) {
     return VirtualAlloc(address, size, MEM_RESERVE, PAGE_NOACCESS);
 }
 
-void virtual_free_release(void* address) { VirtualFree(address, 0, MEM_RELEASE); }
+inline void virtual_free_release(void* address, size_t size) { VirtualFree(address, 0, MEM_RELEASE); }
+
+inline bool decomit(void* address, size_t size) { return VirtualFree(address, size, MEM_DECOMMIT) != 0; }
+
+// private pages can't be moved between addresses without a file mapping, callers copy instead
+inline void* virtual_remap(void* old_address, size_t size, void* new_address, bool& old_lost) { return nullptr; }
+
+inline size_t physical_memory_size() {
+    MEMORYSTATUSEX mem_status = { sizeof(mem_status) };
+    GlobalMemoryStatusEx(&mem_status);
+    return mem_status.ullTotalPhys;
+}
+
+inline size_t virtual_alloc_granularity() {
+    SYSTEM_INFO sys_info;
+    GetSystemInfo(&sys_info);
+    return sys_info.dwAllocationGranularity;
+}
+
+#elif defined(PLATFORM_LINUX)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <unistd.h>
+
+// the node is only used on windows, on linux the reservation was bound to it once
+inline void* virtual_alloc_commit(void* address, size_t size, u32 = any_numa_node) {
+    return mprotect(address, size, PROT_READ | PROT_WRITE) == 0 ? address : nullptr;
+}
+
+inline void* virtual_alloc_commit_huge(void* address, size_t size, u32 = any_numa_node) {
+    if (!virtual_alloc_commit(address, size))
+        return nullptr;
 
-BOOL decomit(void* address, size_t size) { return VirtualFree(address, size, MEM_DECOMMIT); }
+    // only a hint, the kernel falls back to small pages when thp is disabled
+    madvise(address, size, MADV_HUGEPAGE);
+    return address;
+}
+
+inline void* virtual_alloc_reserve(void* address, size_t size) {
+    void* result = mmap(address, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return result == MAP_FAILED ? nullptr : result;
+}
+
+inline void virtual_free_release(void* address, size_t size) { munmap(address, size); }
+
+// pages of the range fault in on node from now on, also after they were
+// dropped with decomit. the node is preferred rather than required, a full
+// node spills over to the others instead of failing the fault. called with
+// mbind directly so there is no libnuma to link
+inline bool virtual_alloc_bind_node(void* address, size_t size, u32 node) {
+    if (node >= sizeof(unsigned long) * 8)
+        return false;
+
+    unsigned long mask = 1ul << node;
+    return syscall(SYS_mbind, address, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) == 0;
+}
+
+// physical pages are dropped but the range stays read/write, flipping it back to
+// PROT_NONE would split the mapping on every free and run into vm.max_map_count
+inline bool decomit(void* address, size_t size) { return madvise(address, size, MADV_DONTNEED) == 0; }
+
+// moves the pages backing [old_address, old_address + size) to new_address without
+// copying, whatever was mapped at new_address is replaced. the old range is mapped
+// again as empty read/write memory so it stays inside the reservation. when that
+// fails the pages still moved but the old range is a hole any later mmap can land
+// in, old_lost is set and the range must never be handed out again
+inline void* virtual_remap(void* old_address, size_t size, void* new_address, bool& old_lost) {
+    void* result = mremap(old_address, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, new_address);
+    if (result == MAP_FAILED)
+        return nullptr;
+
+    void* refill = mmap(old_address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    old_lost = refill == MAP_FAILED;
+    return result;
+}
+
+inline size_t physical_memory_size() {
+    return (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+inline size_t virtual_alloc_granularity() {
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
 
-#endif
\ No newline at end of file
+#endif
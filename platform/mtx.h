@@ -1,32 +1,437 @@
 #pragma once
+#include <atomic>
+#include "lock_profile.h"
 
 #ifdef PLATFORM_WINDOWS
 
 #include <synchapi.h>
+#pragma comment(lib, "Synchronization.lib")
+
 class pltf_mutex {
 public:
     void lock_shared() { AcquireSRWLockShared(&lock); }
     void unlock_shared() { ReleaseSRWLockShared(&lock); }
+    bool try_lock_shared() { return TryAcquireSRWLockShared(&lock) != 0; }
 
     void lock_exclusive() { AcquireSRWLockExclusive(&lock); }
     void unlock_exclusive() { ReleaseSRWLockExclusive(&lock); }
+    bool try_lock_exclusive() { return TryAcquireSRWLockExclusive(&lock) != 0; }
 private:
     SRWLOCK lock = SRWLOCK_INIT;
 };
+
+FORCE_INLINE void pltf_cpu_relax()
+{
+#if defined(_M_ARM64)
+    __yield();
+#else
+    _mm_pause();
+#endif
+}
+
+// sleeps while *address still holds expected, may return spuriously
+inline void pltf_wait_on_address(std::atomic<u32>* address, u32 expected)
+{
+    WaitOnAddress(reinterpret_cast<volatile void*>(address), &expected, sizeof(u32), INFINITE);
+}
+
+inline void pltf_wake_one(std::atomic<u32>* address) { WakeByAddressSingle(reinterpret_cast<void*>(address)); }
+inline void pltf_wake_all(std::atomic<u32>* address) { WakeByAddressAll(reinterpret_cast<void*>(address)); }
+
+#elif defined(PLATFORM_LINUX)
+
+#include <pthread.h>
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+class pltf_mutex {
+public:
+    void lock_shared() { pthread_rwlock_rdlock(&lock); }
+    void unlock_shared() { pthread_rwlock_unlock(&lock); }
+    bool try_lock_shared() { return pthread_rwlock_tryrdlock(&lock) == 0; }
+
+    void lock_exclusive() { pthread_rwlock_wrlock(&lock); }
+    void unlock_exclusive() { pthread_rwlock_unlock(&lock); }
+    bool try_lock_exclusive() { return pthread_rwlock_trywrlock(&lock) == 0; }
+private:
+    pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+};
+
+FORCE_INLINE void pltf_cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+inline void pltf_wait_on_address(std::atomic<u32>* address, u32 expected)
+{
+    syscall(SYS_futex, reinterpret_cast<u32*>(address), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline void pltf_wake_one(std::atomic<u32>* address) { syscall(SYS_futex, reinterpret_cast<u32*>(address), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0); }
+inline void pltf_wake_all(std::atomic<u32>* address) { syscall(SYS_futex, reinterpret_cast<u32*>(address), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0); }
+
+#endif
+
+// the locks below are built on atomics and the wait on address calls above.
+// they spin for a bounded number of pauses before parking, so the short
+// critical sections of the allocators never reach the kernel unless the owner
+// got preempted. define PLTF_LOCK_STATS to count contended acquisitions and
+// parks per lock
+#ifdef PLTF_LOCK_STATS
+struct pltf_lock_stats {
+    std::atomic<u64> contended{ 0 };
+    std::atomic<u64> parked{ 0 };
+};
+
+#define PLTF_LOCK_STATS_MEMBER pltf_lock_stats lock_stats;
+#define PLTF_LOCK_COUNT(counter) lock_stats.counter.fetch_add(1, std::memory_order_relaxed)
+#else
+#define PLTF_LOCK_STATS_MEMBER
+#define PLTF_LOCK_COUNT(counter) ((void)0)
 #endif
 
+// exclusive lock, three states: free, held, held with parked waiters. a
+// contended lock spins with exponential backoff for up to twice the lock's
+// spin estimate before parking. the estimate is a running average of how long
+// recent contended acquisitions spun (the same scheme as glibc's adaptive
+// mutex), capped at max_spins so a waiter never burns more than a few
+// microseconds before it sleeps
+class pltf_spin_mutex {
+public:
+    static constexpr u32 min_spins = 16;
+    static constexpr u32 max_spins = 2048;
+
+    FORCE_INLINE void lock_exclusive()
+    {
+        u32 expected = unlocked;
+        if (!state.compare_exchange_strong(expected, locked, std::memory_order_acquire, std::memory_order_relaxed))
+            lock_contended();
+    }
+
+    FORCE_INLINE bool try_lock_exclusive()
+    {
+        u32 expected = unlocked;
+        return state.load(std::memory_order_relaxed) == unlocked &&
+            state.compare_exchange_strong(expected, locked, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    FORCE_INLINE void unlock_exclusive()
+    {
+        if (state.exchange(unlocked, std::memory_order_release) == parked)
+            pltf_wake_one(&state);
+    }
+
+    PLTF_LOCK_STATS_MEMBER
+
+private:
+    static constexpr u32 unlocked = 0;
+    static constexpr u32 locked = 1;
+    static constexpr u32 parked = 2;
+
+    std::atomic<u32> state{ unlocked };
+    std::atomic<u32> spin_estimate{ min_spins };
+
+    NO_INLINE void lock_contended()
+    {
+        PLTF_LOCK_COUNT(contended);
+
+        u32 estimate = spin_estimate.load(std::memory_order_relaxed);
+        u32 limit = estimate * 2 < max_spins ? estimate * 2 : max_spins;
+        u32 spins = 0;
+
+        for (u32 backoff = 1; spins < limit; backoff = backoff < 64 ? backoff * 2 : backoff)
+        {
+            for (u32 i = 0; i < backoff; ++i)
+                pltf_cpu_relax();
+
+            spins += backoff;
+
+            if (try_lock_exclusive())
+            {
+                adapt(estimate, spins);
+                return;
+            }
+        }
+
+        adapt(estimate, limit);
+
+        // from here on the lock is taken as parked, the unlock after ours may
+        // wake a thread for nothing but never misses one
+        while (state.exchange(parked, std::memory_order_acquire) != unlocked)
+        {
+            PLTF_LOCK_COUNT(parked);
+            pltf_wait_on_address(&state, parked);
+        }
+    }
+
+    void adapt(u32 estimate, u32 spins)
+    {
+        i32 next = (i32)estimate + ((i32)spins - (i32)estimate) / 8;
+        spin_estimate.store(next < (i32)min_spins ? min_spins : (u32)next, std::memory_order_relaxed);
+    }
+};
+
+// fair exclusive lock, threads get the lock in the order they asked for it.
+// a waiter backs off in proportion to its distance from the head of the
+// queue and parks once it has spun for max_spins
+class pltf_ticket_mutex {
+public:
+    static constexpr u32 max_spins = 2048;
+
+    FORCE_INLINE void lock_exclusive()
+    {
+        u32 ticket = next_ticket.fetch_add(1, std::memory_order_relaxed);
+        u32 serving = now_serving.load(std::memory_order_acquire);
+
+        if (serving != ticket)
+            lock_contended(ticket, serving);
+    }
+
+    FORCE_INLINE bool try_lock_exclusive()
+    {
+        u32 serving = now_serving.load(std::memory_order_relaxed);
+        u32 expected = serving;
+        return next_ticket.compare_exchange_strong(expected, serving + 1, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    FORCE_INLINE void unlock_exclusive()
+    {
+        now_serving.fetch_add(1, std::memory_order_seq_cst);
+
+        if (sleepers.load(std::memory_order_seq_cst))
+            pltf_wake_all(&now_serving);
+    }
+
+    PLTF_LOCK_STATS_MEMBER
+
+private:
+    std::atomic<u32> next_ticket{ 0 };
+    std::atomic<u32> now_serving{ 0 };
+    std::atomic<u32> sleepers{ 0 };
+
+    NO_INLINE void lock_contended(u32 ticket, u32 serving)
+    {
+        PLTF_LOCK_COUNT(contended);
+
+        for (u32 spins = 0; serving != ticket; serving = now_serving.load(std::memory_order_acquire))
+        {
+            if (spins < max_spins)
+            {
+                u32 backoff = (ticket - serving) * 16;
+
+                for (u32 i = 0; i < backoff; ++i)
+                    pltf_cpu_relax();
+
+                spins += backoff;
+                continue;
+            }
+
+            // every unlock wakes all sleepers, the ones whose turn it isn't
+            // go straight back to sleep
+            PLTF_LOCK_COUNT(parked);
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            pltf_wait_on_address(&now_serving, serving);
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+// writer preferring reader writer lock. a waiting writer sets writer_waiting,
+// which keeps new readers out until the writer got its turn, so a steady
+// stream of readers can't starve it
+class pltf_rw_lock {
+public:
+    static constexpr u32 max_spins = 1024;
+
+    FORCE_INLINE void lock_shared()
+    {
+        u32 current = state.load(std::memory_order_relaxed);
+
+        if ((current & (writer | writer_waiting)) ||
+            !state.compare_exchange_strong(current, current + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            lock_shared_contended();
+    }
+
+    FORCE_INLINE bool try_lock_shared()
+    {
+        u32 current = state.load(std::memory_order_relaxed);
+        return !(current & (writer | writer_waiting)) &&
+            state.compare_exchange_strong(current, current + 1, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    FORCE_INLINE void unlock_shared()
+    {
+        u32 left = state.fetch_sub(1, std::memory_order_seq_cst) - 1;
+
+        if (!(left & reader_mask) && (left & writer_waiting))
+            wake();
+    }
+
+    FORCE_INLINE void lock_exclusive()
+    {
+        u32 expected = 0;
+        if (!state.compare_exchange_strong(expected, writer, std::memory_order_acquire, std::memory_order_relaxed))
+            lock_exclusive_contended();
+    }
+
+    FORCE_INLINE bool try_lock_exclusive()
+    {
+        u32 current = state.load(std::memory_order_relaxed);
+        return !(current & ~writer_waiting) &&
+            state.compare_exchange_strong(current, writer, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    FORCE_INLINE void unlock_exclusive()
+    {
+        state.fetch_and(~writer, std::memory_order_seq_cst);
+        wake();
+    }
+
+    PLTF_LOCK_STATS_MEMBER
+
+private:
+    static constexpr u32 writer = 1u << 31;
+    static constexpr u32 writer_waiting = 1u << 30;
+    static constexpr u32 reader_mask = writer_waiting - 1;
+
+    std::atomic<u32> state{ 0 };
+    std::atomic<u32> sleepers{ 0 };
+
+    void wake()
+    {
+        if (sleepers.load(std::memory_order_seq_cst))
+            pltf_wake_all(&state);
+    }
+
+    // spins while the word still reads current, then parks on it
+    void wait(u32 current, u32& spins)
+    {
+        if (spins < max_spins)
+        {
+            for (u32 i = 0; i < 16; ++i)
+                pltf_cpu_relax();
+
+            spins += 16;
+            return;
+        }
+
+        PLTF_LOCK_COUNT(parked);
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        pltf_wait_on_address(&state, current);
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    NO_INLINE void lock_shared_contended()
+    {
+        PLTF_LOCK_COUNT(contended);
+
+        for (u32 spins = 0;;)
+        {
+            u32 current = state.load(std::memory_order_relaxed);
+
+            if (current & (writer | writer_waiting))
+            {
+                wait(current, spins);
+                continue;
+            }
+
+            if (state.compare_exchange_weak(current, current + 1, std::memory_order_acquire, std::memory_order_relaxed))
+                return;
+        }
+    }
+
+    // taking the lock clears writer_waiting, any other writer still waiting
+    // sets it again before it parks
+    NO_INLINE void lock_exclusive_contended()
+    {
+        PLTF_LOCK_COUNT(contended);
+
+        for (u32 spins = 0;;)
+        {
+            u32 current = state.load(std::memory_order_relaxed);
+
+            if (!(current & ~writer_waiting))
+            {
+                if (state.compare_exchange_weak(current, writer, std::memory_order_acquire, std::memory_order_relaxed))
+                    return;
+
+                continue;
+            }
+
+            if (!(current & writer_waiting) &&
+                !state.compare_exchange_weak(current, current | writer_waiting, std::memory_order_relaxed, std::memory_order_relaxed))
+                continue;
+
+            wait(current | writer_waiting, spins);
+        }
+    }
+};
+
+// the name, or its site from PLTF_LOCK_SITE, is what PLTF_LOCK_PROFILE builds
+// count the lock under, see lock_profile.h. a guard can let go of its lock
+// early with unlock()
+template <typename lock_t>
 class pltf_lock_guard {
 public:
-    pltf_lock_guard(pltf_mutex& m) : mutex(&m) { mutex->lock_exclusive(); }
-    ~pltf_lock_guard() { mutex->unlock_exclusive(); }
+#ifdef PLTF_LOCK_PROFILE
+    pltf_lock_guard(lock_t& m, pltf_lock_site* site) : mutex(&m)
+    {
+        probe.acquire(site, [this] { return mutex->try_lock_exclusive(); }, [this] { mutex->lock_exclusive(); });
+    }
+
+    pltf_lock_guard(lock_t& m, const char* name = nullptr) : pltf_lock_guard(m, pltf_lock_profiler.site(name)) {}
+
+    void unlock()
+    {
+        probe.release();
+        mutex->unlock_exclusive();
+        mutex = nullptr;
+    }
+#else
+    pltf_lock_guard(lock_t& m, const char* = nullptr) : mutex(&m) { mutex->lock_exclusive(); }
+    void unlock() { mutex->unlock_exclusive(); mutex = nullptr; }
+#endif
+
+    ~pltf_lock_guard() { if (mutex) unlock(); }
 private:
-    pltf_mutex* mutex;
+    lock_t* mutex;
+#ifdef PLTF_LOCK_PROFILE
+    pltf_lock_probe probe;
+#endif
 };
 
+template <typename lock_t>
 class pltf_shared_guard {
 public:
-    pltf_shared_guard(pltf_mutex& m) : mutex(&m) { mutex->lock_shared(); }
-    ~pltf_shared_guard() { mutex->unlock_shared(); }
+#ifdef PLTF_LOCK_PROFILE
+    pltf_shared_guard(lock_t& m, pltf_lock_site* site) : mutex(&m)
+    {
+        probe.acquire(site, [this] { return mutex->try_lock_shared(); }, [this] { mutex->lock_shared(); });
+    }
+
+    pltf_shared_guard(lock_t& m, const char* name = nullptr) : pltf_shared_guard(m, pltf_lock_profiler.site(name)) {}
+
+    void unlock()
+    {
+        probe.release();
+        mutex->unlock_shared();
+        mutex = nullptr;
+    }
+#else
+    pltf_shared_guard(lock_t& m, const char* = nullptr) : mutex(&m) { mutex->lock_shared(); }
+    void unlock() { mutex->unlock_shared(); mutex = nullptr; }
+#endif
+
+    ~pltf_shared_guard() { if (mutex) unlock(); }
 private:
-    pltf_mutex* mutex;
+    lock_t* mutex;
+#ifdef PLTF_LOCK_PROFILE
+    pltf_lock_probe probe;
+#endif
 };
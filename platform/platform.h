@@ -1,9 +1,14 @@
 #pragma once
 
 #include "datatypes.h"
+#include "bitops.h"
 #include "mtx.h"
+#include "thread.h"
 #include "io.h"
 #include "mem.h"
 #include "vmm.h"
+#include "jobs.h"
+#include "queue.h"
+#include "io_stream.h"
 
 
@@ -0,0 +1,641 @@
+#pragma once
+#include "datatypes.h"
+#include "mtx.h"
+#include "vmm.h"
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// lock free queues for handing work between threads. none of them ever waits
+// on another thread: a producer finishes its push however far the others got,
+// a consumer that finds nothing ready returns empty handed and comes back
+// later
+
+struct pltf_mpsc_node {
+    std::atomic<pltf_mpsc_node*> next{ nullptr };
+};
+
+// vyukov's intrusive multi producer single consumer queue, unbounded and
+// without any allocation, the nodes are embedded in the queued objects. a
+// push is one exchange. pop can come back empty while a producer is between
+// its two steps, the node shows up on a later pop. nodes come out in the
+// order their pushes did the exchange. the queue holds a stub node of its
+// own and can't be moved
+class pltf_mpsc_queue {
+public:
+    pltf_mpsc_queue() : back(&stub), front(&stub) {}
+
+    pltf_mpsc_queue(const pltf_mpsc_queue&) = delete;
+    pltf_mpsc_queue& operator=(const pltf_mpsc_queue&) = delete;
+
+    void push(pltf_mpsc_node* node)
+    {
+        push_batch(node, node);
+    }
+
+    // the nodes from first to last must already be linked through next, the
+    // whole chain goes in with one exchange and stays together
+    void push_batch(pltf_mpsc_node* first, pltf_mpsc_node* last)
+    {
+        last->next.store(nullptr, std::memory_order_relaxed);
+        pltf_mpsc_node* prev = back.exchange(last, std::memory_order_acq_rel);
+        prev->next.store(first, std::memory_order_release);
+    }
+
+    // consumer only
+    pltf_mpsc_node* pop()
+    {
+        pltf_mpsc_node* node = front;
+        pltf_mpsc_node* next = node->next.load(std::memory_order_acquire);
+
+        if (node == &stub)
+        {
+            if (!next)
+                return nullptr;
+
+            front = next;
+            node = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next)
+        {
+            front = next;
+            return node;
+        }
+
+        // the node is the last one unless a push is under way
+        if (node != back.load(std::memory_order_acquire))
+            return nullptr;
+
+        // the stub goes behind it so the node can be handed out
+        push(&stub);
+        next = node->next.load(std::memory_order_acquire);
+
+        if (next)
+        {
+            front = next;
+            return node;
+        }
+
+        return nullptr;
+    }
+
+    // consumer only, pops up to max nodes into out and returns how many
+    u32 pop_batch(pltf_mpsc_node** out, u32 max)
+    {
+        u32 count = 0;
+
+        while (count < max)
+        {
+            pltf_mpsc_node* node = pop();
+            if (!node)
+                break;
+
+            out[count++] = node;
+        }
+
+        return count;
+    }
+
+    // only a hint while producers are pushing
+    bool empty() const
+    {
+        return front == &stub && !stub.next.load(std::memory_order_acquire) && back.load(std::memory_order_acquire) == &stub;
+    }
+
+private:
+    alignas(64) std::atomic<pltf_mpsc_node*> back;
+    alignas(64) pltf_mpsc_node* front;
+    pltf_mpsc_node stub;
+};
+
+// vyukov's bounded multi producer multi consumer ring. every cell carries a
+// sequence number that says whose turn it is, a producer may fill the cell
+// at position p once it reads p, a consumer may empty it once it reads p + 1.
+// producers only touch the enqueue position and consumers only the dequeue
+// position, so the two sides never share a contended line. capacity must be
+// a power of two
+template <typename value_t, u32 capacity>
+class pltf_mpmc_ring {
+    static_assert(capacity >= 2 && !(capacity & (capacity - 1)), "ring capacity must be a power of two");
+
+public:
+    pltf_mpmc_ring()
+    {
+        for (u32 i = 0; i < capacity; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~pltf_mpmc_ring()
+    {
+        u32 end = enqueue_pos.load(std::memory_order_relaxed);
+
+        for (u32 pos = dequeue_pos.load(std::memory_order_relaxed); pos != end; ++pos)
+            std::launder(reinterpret_cast<value_t*>(cells[pos & (capacity - 1)].storage))->~value_t();
+    }
+
+    pltf_mpmc_ring(const pltf_mpmc_ring&) = delete;
+    pltf_mpmc_ring& operator=(const pltf_mpmc_ring&) = delete;
+
+    // false when the ring is full
+    template <typename arg_t>
+    bool try_push(arg_t&& value)
+    {
+        u32 pos;
+        cell_t* cell = claim(enqueue_pos, 0, pos);
+
+        if (!cell)
+            return false;
+
+        new (cell->storage) value_t(std::forward<arg_t>(value));
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // false when no value is ready
+    bool try_pop(value_t& value)
+    {
+        u32 pos;
+        cell_t* cell = claim(dequeue_pos, 1, pos);
+
+        if (!cell)
+            return false;
+
+        take(cell, value, pos);
+        return true;
+    }
+
+    // claims as many cells in a row as are free, up to count, with one
+    // compare exchange and returns how many values went in
+    u32 push_batch(const value_t* values, u32 count)
+    {
+        u32 pos;
+        u32 claimed = claim_batch(enqueue_pos, 0, count, pos);
+
+        for (u32 i = 0; i < claimed; ++i)
+        {
+            cell_t& cell = cells[(pos + i) & (capacity - 1)];
+            new (cell.storage) value_t(values[i]);
+            cell.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+
+        return claimed;
+    }
+
+    u32 pop_batch(value_t* out, u32 max)
+    {
+        u32 pos;
+        u32 claimed = claim_batch(dequeue_pos, 1, max, pos);
+
+        for (u32 i = 0; i < claimed; ++i)
+            take(&cells[(pos + i) & (capacity - 1)], out[i], pos + i);
+
+        return claimed;
+    }
+
+    // only a hint while others are pushing and popping
+    u32 size() const
+    {
+        u32 in = enqueue_pos.load(std::memory_order_acquire);
+        u32 out = dequeue_pos.load(std::memory_order_acquire);
+        return in - out <= capacity ? in - out : 0;
+    }
+
+private:
+    struct cell_t {
+        std::atomic<u32> sequence;
+        alignas(value_t) unsigned char storage[sizeof(value_t)];
+    };
+
+    alignas(64) std::atomic<u32> enqueue_pos{ 0 };
+    alignas(64) std::atomic<u32> dequeue_pos{ 0 };
+    alignas(64) cell_t cells[capacity];
+
+    // a consumer frees the cell for the producer one lap ahead
+    void take(cell_t* cell, value_t& value, u32 pos)
+    {
+        value_t* stored = std::launder(reinterpret_cast<value_t*>(cell->storage));
+        value = std::move(*stored);
+        stored->~value_t();
+        cell->sequence.store(pos + capacity, std::memory_order_release);
+    }
+
+    // the cell at the side's position is ready once its sequence reads the
+    // position plus ahead. positions wrap, they are compared as differences
+    cell_t* claim(std::atomic<u32>& position, u32 ahead, u32& pos)
+    {
+        pos = position.load(std::memory_order_relaxed);
+
+        for (;;)
+        {
+            cell_t* cell = &cells[pos & (capacity - 1)];
+            i32 diff = (i32)(cell->sequence.load(std::memory_order_acquire) - (pos + ahead));
+
+            if (diff == 0)
+            {
+                if (position.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    return cell;
+            }
+            else if (diff < 0)
+                return nullptr;
+            else
+                pos = position.load(std::memory_order_relaxed);
+        }
+    }
+
+    u32 claim_batch(std::atomic<u32>& position, u32 ahead, u32 count, u32& pos)
+    {
+        pos = position.load(std::memory_order_relaxed);
+
+        for (;;)
+        {
+            u32 ready = 0;
+
+            while (ready < count && ready < capacity &&
+                cells[(pos + ready) & (capacity - 1)].sequence.load(std::memory_order_acquire) == pos + ready + ahead)
+                ++ready;
+
+            if (!ready)
+            {
+                i32 diff = (i32)(cells[pos & (capacity - 1)].sequence.load(std::memory_order_acquire) - (pos + ahead));
+                if (diff <= 0)
+                    return 0;
+
+                pos = position.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (position.compare_exchange_weak(pos, pos + ready, std::memory_order_relaxed))
+                return ready;
+        }
+    }
+};
+
+// unbounded multi producer multi consumer queue made of a linked list of
+// segments. every segment is filled front to back exactly once, producers
+// claim cells with the segment's enqueue position and consumers with its
+// dequeue position, and once all of its cells were taken the segment is
+// unlinked. a producer that finds the tail segment full links a new one.
+//
+// segments come from the general heap and are kept by the queue until it is
+// destroyed: an unlinked segment goes on a free list for the next link. a
+// thread holds a reference on the segment it works in, taken and then checked
+// against the head or tail pointer it came from, so a segment is only
+// recycled once nobody can still be inside it. that also keeps the compare
+// exchanges on the head, tail and next pointers free of aba
+template <typename value_t, u32 segment_size = 512>
+class pltf_mpmc_queue {
+public:
+    pltf_mpmc_queue() = default;
+
+    ~pltf_mpmc_queue()
+    {
+        segment_t* segment = head.load(std::memory_order_relaxed);
+
+        while (segment)
+        {
+            segment_t* next = segment->next.load(std::memory_order_relaxed);
+
+            for (u32 i = segment->dequeue_pos.load(std::memory_order_relaxed); i < segment->enqueue_pos.load(std::memory_order_relaxed) && i < segment_size; ++i)
+                segment->value(i)->~value_t();
+
+            release_memory(segment);
+            segment = next;
+        }
+
+        segment = free_list.load(std::memory_order_relaxed);
+
+        while (segment)
+        {
+            segment_t* next = segment->free_next;
+            release_memory(segment);
+            segment = next;
+        }
+    }
+
+    pltf_mpmc_queue(const pltf_mpmc_queue&) = delete;
+    pltf_mpmc_queue& operator=(const pltf_mpmc_queue&) = delete;
+
+    // false only when a new segment could not be allocated
+    template <typename arg_t>
+    bool push(arg_t&& value)
+    {
+        for (;;)
+        {
+            segment_t* segment = acquire(tail);
+            if (!segment)
+                return false;
+
+            u32 pos = segment->enqueue_pos.load(std::memory_order_relaxed);
+
+            while (pos < segment_size)
+            {
+                if (segment->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    new (segment->cells[pos].storage) value_t(std::forward<arg_t>(value));
+                    segment->cells[pos].ready.store(1, std::memory_order_release);
+                    release(segment);
+                    return true;
+                }
+            }
+
+            bool linked = advance_tail(segment);
+            release(segment);
+
+            if (!linked)
+                return false;
+        }
+    }
+
+    // pushes as many as fit into the tail segment with one compare exchange,
+    // the rest into the segments after it. false when a segment could not be
+    // allocated, the values before that point went in
+    bool push_batch(const value_t* values, u32 count)
+    {
+        while (count)
+        {
+            segment_t* segment = acquire(tail);
+            if (!segment)
+                return false;
+
+            u32 pos = segment->enqueue_pos.load(std::memory_order_relaxed);
+
+            while (pos < segment_size)
+            {
+                u32 claimed = segment_size - pos < count ? segment_size - pos : count;
+
+                if (segment->enqueue_pos.compare_exchange_weak(pos, pos + claimed, std::memory_order_relaxed))
+                {
+                    for (u32 i = 0; i < claimed; ++i)
+                    {
+                        new (segment->cells[pos + i].storage) value_t(values[i]);
+                        segment->cells[pos + i].ready.store(1, std::memory_order_release);
+                    }
+
+                    values += claimed;
+                    count -= claimed;
+                    break;
+                }
+            }
+
+            bool linked = !count || advance_tail(segment);
+            release(segment);
+
+            if (!linked)
+                return false;
+        }
+
+        return true;
+    }
+
+    // false when nothing is ready. a value whose producer claimed its cell
+    // but hasn't written it yet holds back the ones behind it
+    bool try_pop(value_t& value)
+    {
+        return pop_batch(&value, 1) == 1;
+    }
+
+    u32 pop_batch(value_t* out, u32 max)
+    {
+        u32 count = 0;
+
+        if (!head.load(std::memory_order_acquire))
+            return 0;
+
+        while (count < max)
+        {
+            segment_t* segment = acquire(head);
+            u32 pos = segment->dequeue_pos.load(std::memory_order_relaxed);
+            u32 claimed = 0;
+
+            while (pos < segment_size)
+            {
+                u32 limit = segment_size - pos < max - count ? segment_size - pos : max - count;
+                u32 ready = 0;
+
+                while (ready < limit && segment->cells[pos + ready].ready.load(std::memory_order_acquire))
+                    ++ready;
+
+                if (!ready)
+                    break;
+
+                if (segment->dequeue_pos.compare_exchange_weak(pos, pos + ready, std::memory_order_relaxed))
+                {
+                    claimed = ready;
+                    break;
+                }
+            }
+
+            for (u32 i = 0; i < claimed; ++i)
+            {
+                value_t* stored = segment->value(pos + i);
+                out[count++] = std::move(*stored);
+                stored->~value_t();
+            }
+
+            bool drained = pos + claimed >= segment_size;
+            bool moved = drained && advance_head(segment);
+
+            release(segment);
+
+            // an empty cell in the way or the last segment drained
+            if (!claimed && !moved)
+                break;
+        }
+
+        return count;
+    }
+
+private:
+    // the reference count of the threads inside the segment, with retired set
+    // once it was unlinked. whoever takes the count to zero on a retired
+    // segment puts it on the free list
+    static constexpr u32 retired = 1u << 31;
+
+    struct cell_t {
+        std::atomic<u32> ready;
+        alignas(value_t) unsigned char storage[sizeof(value_t)];
+    };
+
+    struct alignas(64) segment_t {
+        std::atomic<segment_t*> next;
+        std::atomic<u32> state;
+        segment_t* free_next;
+
+        alignas(64) std::atomic<u32> enqueue_pos;
+        alignas(64) std::atomic<u32> dequeue_pos;
+        cell_t cells[segment_size];
+
+        value_t* value(u32 index) { return std::launder(reinterpret_cast<value_t*>(cells[index].storage)); }
+    };
+
+    alignas(64) std::atomic<segment_t*> head{ nullptr };
+    alignas(64) std::atomic<segment_t*> tail{ nullptr };
+    alignas(64) std::atomic<segment_t*> free_list{ nullptr };
+
+    // the first segment is linked on first use so an unused queue costs nothing
+    NO_INLINE segment_t* first_segment()
+    {
+        segment_t* segment = new_segment();
+        if (!segment)
+            return nullptr;
+
+        segment_t* expected = nullptr;
+
+        if (!head.compare_exchange_strong(expected, segment, std::memory_order_acq_rel))
+        {
+            recycle(segment);
+            return expected;
+        }
+
+        tail.store(segment, std::memory_order_release);
+        return segment;
+    }
+
+    // a reference on the segment end points to, null only when the first
+    // segment could not be allocated
+    segment_t* acquire(std::atomic<segment_t*>& end)
+    {
+        for (;;)
+        {
+            segment_t* segment = end.load(std::memory_order_acquire);
+
+            if (!segment)
+            {
+                first_segment();
+
+                // tail is set right after head, spin the few instructions
+                // until it is
+                while (!(segment = end.load(std::memory_order_acquire)) && head.load(std::memory_order_acquire))
+                    pltf_cpu_relax();
+
+                if (!segment)
+                    return nullptr;
+            }
+
+            segment->state.fetch_add(1, std::memory_order_seq_cst);
+
+            if (end.load(std::memory_order_seq_cst) == segment)
+                return segment;
+
+            release(segment);
+        }
+    }
+
+    void release(segment_t* segment)
+    {
+        if (segment->state.fetch_sub(1, std::memory_order_acq_rel) - 1 != retired)
+            return;
+
+        u32 expected = retired;
+
+        // a late reference may have been taken in between, its release
+        // recycles the segment instead
+        if (segment->state.compare_exchange_strong(expected, 0, std::memory_order_acq_rel))
+            recycle(segment);
+    }
+
+    // links a segment after the full one and moves the tail to it, false when
+    // there was no memory for it
+    bool advance_tail(segment_t* segment)
+    {
+        segment_t* next = segment->next.load(std::memory_order_acquire);
+
+        if (!next)
+        {
+            segment_t* fresh = new_segment();
+            if (!fresh)
+                return false;
+
+            if (segment->next.compare_exchange_strong(next, fresh, std::memory_order_acq_rel))
+                next = fresh;
+            else
+                recycle(fresh);
+        }
+
+        tail.compare_exchange_strong(segment, next, std::memory_order_acq_rel);
+        return true;
+    }
+
+    // moves the head past a drained segment, false when it's the last one.
+    // the tail is moved along first so the segment can't be recycled while
+    // it's still reachable from either end
+    bool advance_head(segment_t* segment)
+    {
+        segment_t* next = segment->next.load(std::memory_order_acquire);
+        if (!next)
+            return false;
+
+        segment_t* expected = segment;
+        tail.compare_exchange_strong(expected, next, std::memory_order_acq_rel);
+
+        expected = segment;
+
+        if (head.compare_exchange_strong(expected, next, std::memory_order_acq_rel))
+            segment->state.fetch_add(retired, std::memory_order_acq_rel);
+
+        return true;
+    }
+
+    // the free list is popped whole with an exchange and the rest pushed back,
+    // so a pop never reads the next link of a segment another thread may have
+    // taken in the meantime
+    segment_t* new_segment()
+    {
+        segment_t* segment = free_list.exchange(nullptr, std::memory_order_acquire);
+
+        if (segment)
+        {
+            if (segment_t* rest = segment->free_next)
+            {
+                segment_t* last = rest;
+                while (last->free_next)
+                    last = last->free_next;
+
+                push_free(rest, last);
+            }
+        }
+        else
+        {
+            void* mem = halloc_aligned(sizeof(segment_t), alignof(segment_t));
+            if (!mem)
+                return nullptr;
+
+            segment = new (mem) segment_t();
+            segment->state.store(0, std::memory_order_relaxed);
+        }
+
+        segment->next.store(nullptr, std::memory_order_relaxed);
+        segment->free_next = nullptr;
+        segment->enqueue_pos.store(0, std::memory_order_relaxed);
+        segment->dequeue_pos.store(0, std::memory_order_relaxed);
+
+        for (cell_t& cell : segment->cells)
+            cell.ready.store(0, std::memory_order_relaxed);
+
+        return segment;
+    }
+
+    void recycle(segment_t* segment)
+    {
+        push_free(segment, segment);
+    }
+
+    void push_free(segment_t* first, segment_t* last)
+    {
+        segment_t* top = free_list.load(std::memory_order_relaxed);
+
+        do
+        {
+            last->free_next = top;
+        } while (!free_list.compare_exchange_weak(top, first, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    static void release_memory(segment_t* segment)
+    {
+        segment->~segment_t();
+        hfree(segment);
+    }
+};
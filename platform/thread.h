@@ -0,0 +1,85 @@
+#pragma once
+
+#ifdef PLATFORM_WINDOWS
+
+#include <Windows.h>
+
+FORCE_INLINE u64 pltf_thread_id() { return GetCurrentThreadId(); }
+
+inline u32 pltf_cpu_count() { return (u32)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS); }
+
+// the processor number inside the thread's processor group
+FORCE_INLINE u32 pltf_current_cpu() { return (u32)GetCurrentProcessorNumber(); }
+
+FORCE_INLINE void pltf_thread_yield() { SwitchToThread(); }
+
+// numa nodes are numbered from 0, a machine without numa has one node
+inline u32 pltf_numa_node_count() {
+    ULONG highest = 0;
+    return GetNumaHighestNodeNumber(&highest) ? (u32)highest + 1 : 1;
+}
+
+FORCE_INLINE u32 pltf_current_numa_node() {
+    PROCESSOR_NUMBER processor;
+    USHORT node = 0;
+
+    GetCurrentProcessorNumberEx(&processor);
+    return GetNumaProcessorNodeEx(&processor, &node) ? (u32)node : 0;
+}
+
+#elif defined(PLATFORM_LINUX)
+
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+FORCE_INLINE u64 pltf_thread_id() {
+    static thread_local u64 id = (u64)syscall(SYS_gettid);
+    return id;
+}
+
+inline u32 pltf_cpu_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (u32)count : 1;
+}
+
+FORCE_INLINE u32 pltf_current_cpu() {
+    int cpu = sched_getcpu();
+    return cpu >= 0 ? (u32)cpu : 0;
+}
+
+FORCE_INLINE void pltf_thread_yield() { sched_yield(); }
+
+// the possible nodes are listed as "0", "0-1" or "0,2-3", node numbers can
+// have gaps and the count is the highest one plus one. kernels without numa
+// have no node directory at all
+inline u32 pltf_numa_node_count() {
+    int fd = open("/sys/devices/system/node/possible", O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    char list[256];
+    ssize_t length = read(fd, list, sizeof(list) - 1);
+    close(fd);
+
+    u32 highest = 0, number = 0;
+
+    for (ssize_t i = 0; i < length; ++i) {
+        if (list[i] >= '0' && list[i] <= '9') {
+            number = number * 10 + (u32)(list[i] - '0');
+            highest = number > highest ? number : highest;
+        }
+        else
+            number = 0;
+    }
+
+    return highest + 1;
+}
+
+FORCE_INLINE u32 pltf_current_numa_node() {
+    unsigned int cpu = 0, node = 0;
+    return getcpu(&cpu, &node) == 0 ? (u32)node : 0;
+}
+
+#endif
@@ -1,9 +1,498 @@
 #include <platform.h>
 
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+// stress checks for the lock free queues, the job system, the general heap and
+// deferred reclamation. every test runs a few threads against one structure
+// and checks what comes out against what went in: checksums for the queues,
+// byte patterns for heap blocks and poisoned headers for retired objects. the
+// process exits with the number of failed checks so it can gate a build
+
+static std::atomic<u32> failures{ 0 };
+
+#define CHECK(condition) \
+	do { if (!(condition)) { failures.fetch_add(1, std::memory_order_relaxed); printf("  failed: %s (%s:%d)\n", #condition, __FILE__, __LINE__); } } while (0)
+
+constexpr u32 producers = 4;
+constexpr u32 consumers = 4;
+constexpr u64 items_per_producer = 200000;
+
+// every value tells its producer and sequence number apart, so the expected
+// sum and xor are known up front and a lost, doubled or torn value shows up
+static u64 item_value(u64 producer, u64 i) {
+	return (producer << 40) | (i + 1);
+}
+
+struct checksum_t {
+	u64 count = 0;
+	u64 sum = 0;
+	u64 mix = 0;
+
+	void add(u64 value) {
+		count += 1;
+		sum += value;
+		mix ^= value * 0x9e3779b97f4a7c15ull;
+	}
+
+	void merge(const checksum_t& other) {
+		count += other.count;
+		sum += other.sum;
+		mix ^= other.mix;
+	}
+};
+
+static checksum_t expected_checksum(u32 producer_count) {
+	checksum_t expected;
+	for (u64 p = 0; p < producer_count; ++p)
+		for (u64 i = 0; i < items_per_producer; ++i)
+			expected.add(item_value(p, i));
+	return expected;
+}
+
+static void check_checksum(const checksum_t& got, const checksum_t& expected) {
+	CHECK(got.count == expected.count);
+	CHECK(got.sum == expected.sum);
+	CHECK(got.mix == expected.mix);
+}
+
+// runs producer(p) and consumer(c, checksum) on their own threads, consumers
+// stop once every produced item was taken
+template <typename producer_fn, typename consumer_fn>
+static checksum_t run_queue_test(u32 producer_count, u32 consumer_count, producer_fn&& producer, consumer_fn&& consumer) {
+	std::vector<checksum_t> sums(consumer_count);
+	std::vector<std::thread> threads;
+
+	for (u32 c = 0; c < consumer_count; ++c)
+		threads.emplace_back([&, c] { consumer(c, sums[c]); });
+	for (u32 p = 0; p < producer_count; ++p)
+		threads.emplace_back([&, p] { producer(p); });
+	for (auto& t : threads)
+		t.join();
+
+	checksum_t total;
+	for (auto& s : sums)
+		total.merge(s);
+	return total;
+}
+
+static void mpmc_ring() {
+	static pltf_mpmc_ring<u64, 1024> ring;
+	const u64 total = producers * items_per_producer;
+	std::atomic<u64> taken{ 0 };
+
+	checksum_t got = run_queue_test(producers, consumers,
+		[&](u64 p) {
+			// odd producers go through push_batch to cover both claim paths
+			u64 batch[16];
+			for (u64 i = 0; i < items_per_producer;) {
+				if (p & 1) {
+					u32 count = 0;
+					for (; count < 16 && i + count < items_per_producer; ++count)
+						batch[count] = item_value(p, i + count);
+					u32 pushed = ring.push_batch(batch, count);
+					i += pushed;
+					if (!pushed)
+						pltf_thread_yield();
+				}
+				else if (ring.try_push(item_value(p, i)))
+					++i;
+				else
+					pltf_thread_yield();
+			}
+		},
+		[&](u32 c, checksum_t& sum) {
+			u64 batch[16];
+			while (taken.load(std::memory_order_relaxed) < total) {
+				u32 count = 0;
+				if (c & 1)
+					count = ring.pop_batch(batch, 16);
+				else if (ring.try_pop(batch[0]))
+					count = 1;
+
+				for (u32 i = 0; i < count; ++i)
+					sum.add(batch[i]);
+				if (count)
+					taken.fetch_add(count, std::memory_order_relaxed);
+				else
+					pltf_thread_yield();
+			}
+		});
+
+	check_checksum(got, expected_checksum(producers));
+	CHECK(ring.size() == 0);
+}
+
+static void mpmc_queue() {
+	// small segments so the run links, unlinks and recycles a lot of them
+	static pltf_mpmc_queue<u64, 64> queue;
+	const u64 total = producers * items_per_producer;
+	std::atomic<u64> taken{ 0 };
+
+	checksum_t got = run_queue_test(producers, consumers,
+		[&](u64 p) {
+			u64 batch[37];
+			for (u64 i = 0; i < items_per_producer;) {
+				if (p & 1) {
+					u32 count = 0;
+					for (; count < 37 && i + count < items_per_producer; ++count)
+						batch[count] = item_value(p, i + count);
+					CHECK(queue.push_batch(batch, count));
+					i += count;
+				}
+				else {
+					CHECK(queue.push(item_value(p, i)));
+					++i;
+				}
+			}
+		},
+		[&](u32 c, checksum_t& sum) {
+			u64 batch[37];
+			while (taken.load(std::memory_order_relaxed) < total) {
+				u32 count = 0;
+				if (c & 1)
+					count = queue.pop_batch(batch, 37);
+				else if (queue.try_pop(batch[0]))
+					count = 1;
+
+				for (u32 i = 0; i < count; ++i)
+					sum.add(batch[i]);
+				if (count)
+					taken.fetch_add(count, std::memory_order_relaxed);
+				else
+					pltf_thread_yield();
+			}
+		});
+
+	check_checksum(got, expected_checksum(producers));
+
+	u64 left;
+	CHECK(!queue.try_pop(left));
+}
+
+struct mpsc_item_t {
+	pltf_mpsc_node node;
+	u64 value;
+};
+
+static void mpsc_queue() {
+	static pltf_mpsc_queue queue;
+	const u64 total = producers * items_per_producer;
+	std::vector<mpsc_item_t> items(total);
+
+	checksum_t got = run_queue_test(producers, 1,
+		[&](u64 p) {
+			// pushes alternate between single nodes and chains of four
+			mpsc_item_t* own = &items[p * items_per_producer];
+			for (u64 i = 0; i < items_per_producer;) {
+				u64 chain = (i / 4) & 1 && i + 4 <= items_per_producer ? 4 : 1;
+				for (u64 k = 0; k < chain; ++k) {
+					own[i + k].value = item_value(p, i + k);
+					own[i + k].node.next.store(k + 1 < chain ? &own[i + k + 1].node : nullptr, std::memory_order_relaxed);
+				}
+				queue.push_batch(&own[i].node, &own[i + chain - 1].node);
+				i += chain;
+			}
+		},
+		[&](u32, checksum_t& sum) {
+			pltf_mpsc_node* batch[32];
+			while (sum.count < total) {
+				u32 count = queue.pop_batch(batch, 32);
+				for (u32 i = 0; i < count; ++i)
+					sum.add(reinterpret_cast<mpsc_item_t*>(batch[i])->value);
+				if (!count)
+					pltf_thread_yield();
+			}
+		});
+
+	check_checksum(got, expected_checksum(producers));
+	CHECK(queue.empty());
+}
+
+static void job_sum() {
+	pltf_jobs.initialize();
+
+	const u32 count = 1 << 20;
+	std::atomic<u64> sum{ 0 };
+	pltf_jobs.parallel_for(count, 0, [&](u32 begin, u32 end) {
+		u64 local = 0;
+		for (u32 i = begin; i < end; ++i)
+			local += i;
+		sum.fetch_add(local, std::memory_order_relaxed);
+	});
+	CHECK(sum.load() == u64(count) * (count - 1) / 2);
+
+	// a chain of dependent jobs has to run in order
+	std::atomic<u32> step{ 0 };
+	pltf_job_counter first, second;
+	pltf_jobs.run([&] { CHECK(step.fetch_add(1) == 0); }, &first);
+	pltf_jobs.run_after(first, [&] { CHECK(step.fetch_add(1) == 1); }, &second);
+	pltf_jobs.wait(second);
+	CHECK(step.load() == 2);
+
+	pltf_jobs.shutdown();
+}
+
+// a block's contents are a function of its seed and offset, a block that was
+// handed out twice or lost bytes in a realloc no longer matches
+static void fill_block(u8* base, size_t size, u64 seed) {
+	for (size_t i = 0; i < size; ++i)
+		base[i] = u8((seed * 31 + i * 7) >> 3);
+}
+
+static bool check_block(const u8* base, size_t size, u64 seed) {
+	for (size_t i = 0; i < size; ++i)
+		if (base[i] != u8((seed * 31 + i * 7) >> 3))
+			return false;
+	return true;
+}
+
+struct heap_block_t {
+	u8* base;
+	size_t size;
+	u64 seed;
+};
+
+static void heap_content() {
+	constexpr u32 thread_count = 4;
+	constexpr u32 slots = 512;
+	constexpr u32 rounds = 60000;
+
+	// every thread keeps its own slots and hands some blocks to its neighbour
+	// through an mpmc queue so cross thread frees get their share
+	static pltf_mpmc_queue<heap_block_t> handoff[thread_count];
+	std::vector<std::thread> threads;
+
+	for (u32 t = 0; t < thread_count; ++t) {
+		threads.emplace_back([t] {
+			std::vector<heap_block_t> own(slots, heap_block_t{ nullptr, 0, 0 });
+			u64 state = 0x2545f4914f6cdd1dull + t;
+
+			for (u32 round = 0; round < rounds; ++round) {
+				state ^= state << 13;
+				state ^= state >> 7;
+				state ^= state << 17;
+
+				heap_block_t& block = own[state % slots];
+				// mostly small sizes, now and then a large block
+				size_t size = (state >> 20) % 16 == 0 ? 4096 + (state >> 32) % (256 * 1024) : 1 + (state >> 32) % 512;
+
+				if (!block.base) {
+					block.base = static_cast<u8*>(halloc(size));
+					CHECK(block.base);
+					if (!block.base)
+						continue;
+					block.size = size;
+					block.seed = state;
+					fill_block(block.base, size, block.seed);
+					continue;
+				}
+
+				CHECK(check_block(block.base, block.size, block.seed));
+
+				switch ((state >> 8) % 3) {
+				case 0: {
+					// the prefix both sizes share has to survive the move
+					u8* moved = static_cast<u8*>(hrealloc(block.base, size));
+					CHECK(moved);
+					if (!moved)
+						break;
+					size_t kept = size < block.size ? size : block.size;
+					CHECK(check_block(moved, kept, block.seed));
+					block.base = moved;
+					block.size = size;
+					fill_block(block.base, size, block.seed);
+					break;
+				}
+				case 1:
+					hfree(block.base);
+					block.base = nullptr;
+					break;
+				default:
+					CHECK(handoff[(t + 1) % thread_count].push(block));
+					block.base = nullptr;
+					break;
+				}
+
+				heap_block_t foreign;
+				if (handoff[t].try_pop(foreign)) {
+					CHECK(check_block(foreign.base, foreign.size, foreign.seed));
+					hfree(foreign.base);
+				}
+			}
+
+			for (auto& block : own) {
+				if (!block.base)
+					continue;
+				CHECK(check_block(block.base, block.size, block.seed));
+				hfree(block.base);
+			}
+		});
+	}
+
+	for (auto& t : threads)
+		t.join();
+
+	for (auto& queue : handoff) {
+		heap_block_t foreign;
+		while (queue.try_pop(foreign)) {
+			CHECK(check_block(foreign.base, foreign.size, foreign.seed));
+			hfree(foreign.base);
+		}
+	}
+}
+
+// large aligned blocks sized so that the requested bytes end right at the
+// edge of a pool page once the headers are counted, every byte is written so
+// a payload pushed past the end of its run faults or trips the pattern of a
+// neighbouring block
+static void heap_aligned_large() {
+	const size_t aligns[] = { 32, 64, 4096 };
+	const size_t prefix = 48;
+
+	for (size_t align : aligns) {
+		std::vector<heap_block_t> blocks;
+
+		for (size_t pages = 64; pages < 96; ++pages) {
+			for (size_t slack = 0; slack < 64; slack += 16) {
+				size_t size = pages * 4096 - prefix - slack;
+				auto* base = static_cast<u8*>(halloc_aligned(size, align));
+				CHECK(base);
+				if (!base)
+					continue;
+				CHECK(reinterpret_cast<size_t>(base) % align == 0);
+				fill_block(base, size, pages * 64 + slack);
+				blocks.push_back({ base, size, pages * 64 + slack });
+			}
+		}
+
+		for (auto& block : blocks) {
+			CHECK(check_block(block.base, block.size, block.seed));
+			hfree(block.base);
+		}
+	}
+}
+
+// readers follow a shared pointer while a writer keeps swapping it out and
+// retiring the old object. reclaim poisons the object before it frees it, a
+// reader that ever sees poison read an object that was reclaimed under it
+constexpr u64 object_live = 0x6c6976656f626a31ull;
+constexpr u64 object_dead = 0xdeaddeaddeaddeadull;
+
+struct shared_object_t {
+	std::atomic<u64> magic;
+	u64 value;
+	u64 check;
+};
+
+static std::atomic<u64> objects_reclaimed{ 0 };
+
+static void reclaim_object(void* object) {
+	auto* o = static_cast<shared_object_t*>(object);
+	o->magic.store(object_dead, std::memory_order_relaxed);
+	o->value = ~0ull;
+	hfree(o);
+	objects_reclaimed.fetch_add(1, std::memory_order_relaxed);
+}
+
+static shared_object_t* make_object(u64 value) {
+	auto* o = static_cast<shared_object_t*>(halloc(sizeof(shared_object_t)));
+	o->magic.store(object_live, std::memory_order_relaxed);
+	o->value = value;
+	o->check = ~value;
+	return o;
+}
+
+static void epoch_reclaim() {
+	constexpr u32 reader_count = 4;
+	constexpr u64 swaps = 200000;
+
+	static std::atomic<shared_object_t*> current{ nullptr };
+	std::atomic<bool> done{ false };
+	std::atomic<u64> bad_reads{ 0 };
+
+	vmm_stats before;
+	vmm_get_stats(&before);
+	current.store(make_object(0), std::memory_order_release);
+
+	std::vector<std::thread> readers;
+	for (u32 r = 0; r < reader_count; ++r) {
+		readers.emplace_back([&, r] {
+			u64 last = 0;
+			for (u64 i = 0; !done.load(std::memory_order_relaxed); ++i) {
+				shared_object_t* o = current.load(std::memory_order_acquire);
+				// values only go up, and a reclaimed object reads as poison
+				if (o->magic.load(std::memory_order_relaxed) != object_live || o->check != ~o->value || o->value < last)
+					bad_reads.fetch_add(1, std::memory_order_relaxed);
+				last = o->value;
+
+				if (i % 64 == 0)
+					vmm_quiescent();
+
+				// one reader sleeps offline now and then, it must not hold
+				// reclamation back while away nor miss a retire once back
+				if (r == 0 && i % 4096 == 0) {
+					vmm_thread_offline();
+					pltf_thread_yield();
+					vmm_thread_online();
+				}
+			}
+			vmm_thread_offline();
+		});
+	}
+
+	for (u64 i = 1; i <= swaps; ++i) {
+		shared_object_t* old = current.exchange(make_object(i), std::memory_order_acq_rel);
+		vmm_retire(old, reclaim_object);
+		vmm_quiescent();
+	}
+
+	done.store(true, std::memory_order_relaxed);
+	for (auto& t : readers)
+		t.join();
+
+	CHECK(bad_reads.load() == 0);
+
+	// with every reader offline the writer's own quiescent points are enough
+	// to get all of its limbo reclaimed
+	for (u32 i = 0; i < 8 && objects_reclaimed.load() < swaps; ++i)
+		vmm_quiescent();
+
+	vmm_stats after;
+	vmm_get_stats(&after);
+	CHECK(objects_reclaimed.load() == swaps);
+	CHECK(after.objects_retired - before.objects_retired == swaps);
+	CHECK(after.objects_reclaimed - before.objects_reclaimed == swaps);
+
+	reclaim_object(current.exchange(nullptr));
+	vmm_thread_offline();
+}
+
+struct test_t {
+	const char* name;
+	void (*run)();
+};
+
+static const test_t tests[] = {
+	{ "mpmc ring",      mpmc_ring },
+	{ "mpmc queue",     mpmc_queue },
+	{ "mpsc queue",     mpsc_queue },
+	{ "job sum",        job_sum },
+	{ "heap content",   heap_content },
+	{ "heap aligned",   heap_aligned_large },
+	{ "epoch reclaim",  epoch_reclaim },
+};
+
 int main() {
+	for (const test_t& test : tests) {
+		u32 before = failures.load();
+		test.run();
+		printf("%-16s %s\n", test.name, failures.load() == before ? "ok" : "FAILED");
+	}
 
-	std::cout << valloc(1024 * 1024 * 10) << "\n";
-	std::cout << "why\n";
-	system("pause");
-	return 0;
-}
\ No newline at end of file
+	printf("%u failed checks\n", failures.load());
+	return (int)failures.load();
+}
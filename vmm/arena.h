@@ -0,0 +1,129 @@
+#pragma once
+#include "vmm.h"
+
+// bump pointer arena for scratch data that dies all at once. every generation
+// reserves its full capacity up front through allocate_reserved and commits it
+// in commit_granule steps as the cursor moves, so allocation never copies or
+// moves and reset is just a cursor store. a double buffered arena has two
+// generations, flip makes the other one current so the previous frame's data
+// stays valid for a consumer (the render thread) while the next frame is built.
+// an arena is owned by one thread at a time, nothing here is locked
+class arena_t
+{
+public:
+    static constexpr size_t commit_granule = 64 * 1024;
+    static constexpr size_t default_align = 16;
+
+    bool initialize(virtual_memory_pool* pool, size_t capacity, bool double_buffered)
+    {
+        if (mem_pool)
+            return true;
+
+        mem_pool = pool;
+        generation_count = double_buffered ? 2 : 1;
+        current = 0;
+
+        for (u32 i = 0; i < generation_count; ++i)
+        {
+            generation_t& g = generations[i];
+            size_t initial = capacity < commit_granule ? capacity : commit_granule;
+
+            g.base = static_cast<char*>(mem_pool->allocate_reserved(initial, capacity));
+            g.cursor = 0;
+            g.committed = initial;
+            g.capacity = capacity;
+
+            if (!g.base)
+            {
+                destroy();
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void destroy()
+    {
+        if (!mem_pool)
+            return;
+
+        for (u32 i = 0; i < generation_count; ++i)
+        {
+            if (generations[i].base)
+                mem_pool->free(generations[i].base);
+
+            generations[i] = generation_t{};
+        }
+
+        mem_pool = nullptr;
+    }
+
+    FORCE_INLINE void* allocate(size_t size, size_t align = default_align)
+    {
+        generation_t& g = generations[current];
+
+        size_t address = reinterpret_cast<size_t>(g.base) + g.cursor;
+        size_t start = ((address + align - 1) & ~(align - 1)) - reinterpret_cast<size_t>(g.base);
+        size_t end = start + size;
+
+        if (end > g.committed && !grow(g, end))
+            return nullptr;
+
+        g.cursor = end;
+        return g.base + start;
+    }
+
+    // committed pages are kept, the next frame reuses them without faulting
+    FORCE_INLINE void reset() { generations[current].cursor = 0; }
+
+    FORCE_INLINE size_t mark() const { return generations[current].cursor; }
+
+    FORCE_INLINE void rewind(size_t marker)
+    {
+        if (marker <= generations[current].cursor)
+            generations[current].cursor = marker;
+    }
+
+    // moves on to the next generation and resets it, the one that was current
+    // stays untouched until the flip after this one
+    void flip()
+    {
+        current = (current + 1) % generation_count;
+        generations[current].cursor = 0;
+    }
+
+    size_t used() const { return generations[current].cursor; }
+    size_t committed() const { return generations[current].committed; }
+    size_t capacity() const { return generations[current].capacity; }
+
+private:
+    struct generation_t {
+        char* base = nullptr;
+        size_t cursor = 0;
+        size_t committed = 0;
+        size_t capacity = 0;
+    };
+
+    virtual_memory_pool* mem_pool = nullptr;
+    generation_t generations[2];
+    u32 generation_count = 0;
+    u32 current = 0;
+
+    // the run was reserved with its full capacity so realloc always grows in place
+    NO_INLINE bool grow(generation_t& g, size_t needed)
+    {
+        if (needed > g.capacity)
+            return false;
+
+        size_t target = (needed + commit_granule - 1) & ~(commit_granule - 1);
+        if (target > g.capacity)
+            target = g.capacity;
+
+        if (mem_pool->realloc(g.base, target) != g.base)
+            return false;
+
+        g.committed = target;
+        return true;
+    }
+};
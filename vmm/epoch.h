@@ -0,0 +1,419 @@
+#pragma once
+#include "heap_shards.h"
+
+// epoch based reclamation in its quiescent state form: every thread that takes
+// part announces the points where it holds no pointer into shared structures,
+// the end of a frame or a physics tick, and an object that was unlinked is
+// only reclaimed once every such thread went through one of those points.
+//
+// the global epoch moves on by one as soon as every online thread announced
+// the current one, an object retired during epoch e is safe from e + 2 on.
+// retired objects wait in limbo lists of the retiring thread, one per epoch
+// mod 3, and are reclaimed together by that thread: heap blocks with one batch
+// free, everything else through the reclaim function given with it (an arena
+// reset, a pool free). there is no lock anywhere on this path, announcing is a
+// store and advancing is a scan over the thread records and a compare
+// exchange.
+//
+// memory in limbo is bounded by two epochs worth of retires as long as every
+// online thread keeps announcing. a thread that blocks for long (a loader
+// waiting on the disk, a worker going to sleep) goes offline for that time so
+// it doesn't hold the epoch back, and may not touch shared structures until
+// it is online again. threads are online from their first call on, a thread
+// past max_epoch_threads never holds the epoch back and must only retire
+constexpr u32 max_epoch_threads = 256;
+
+typedef void (*reclaim_fn_t)(void* object);
+
+class epoch_reclaimer_t;
+
+// hands the thread's limbo lists and record back when the thread exits
+struct epoch_thread_exit_t
+{
+    epoch_reclaimer_t* owner = nullptr;
+    ~epoch_thread_exit_t();
+};
+
+inline thread_local epoch_thread_exit_t epoch_thread_exit;
+
+class epoch_reclaimer_t
+{
+public:
+    // entries per limbo batch, a batch is about 4 KiB
+    static constexpr u32 batch_entries = 254;
+
+    // a thread with this many objects in limbo tries to move the epoch on
+    // from retire itself instead of waiting for its next quiescent point
+    static constexpr size_t limbo_limit = 16 * batch_entries;
+
+    // spare batches a thread keeps around instead of freeing them
+    static constexpr u32 max_spare_batches = 4;
+
+    // the calling thread holds no pointers into shared structures
+    void quiescent()
+    {
+        thread_record_t* record = local_record();
+        u64 epoch = global_epoch.load(std::memory_order_seq_cst);
+
+        if (record)
+        {
+            if (record->announced.load(std::memory_order_relaxed) != epoch)
+                record->announced.store(epoch, std::memory_order_seq_cst);
+
+            if (try_advance(epoch))
+                ++epoch;
+
+            reclaim(record, epoch);
+        }
+        else if (try_advance(epoch))
+            ++epoch;
+
+        if (orphans.load(std::memory_order_relaxed))
+            reclaim_orphans(epoch);
+    }
+
+    void offline()
+    {
+        if (thread_record_t* record = local_record())
+            record->announced.store(offline_epoch, std::memory_order_seq_cst);
+    }
+
+    void online()
+    {
+        if (thread_record_t* record = local_record())
+            record->announced.store(global_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    }
+
+    // a null reclaim function frees a heap block
+    void retire(void* object, reclaim_fn_t reclaim_fn = nullptr)
+    {
+        if (!object)
+            return;
+
+        thread_record_t* record = local_record();
+        u64 epoch = global_epoch.load(std::memory_order_seq_cst);
+
+        if (!record)
+        {
+            retire_orphan(object, reclaim_fn, epoch);
+            return;
+        }
+
+        limbo_bin_t& bin = record->bins[epoch % 3];
+
+        // whatever the bin still holds is from three epochs ago or older
+        if (bin.count && bin.epoch != epoch)
+            reclaim_bin(record, bin);
+
+        bin.epoch = epoch;
+
+        if (!bin.first || bin.first->count == batch_entries)
+        {
+            limbo_batch_t* batch = new_batch(record);
+
+            // an exhausted heap leaks the object instead of freeing it early,
+            // it isn't counted as retired either
+            if (!batch)
+                return;
+
+            batch->next = bin.first;
+            bin.first = batch;
+        }
+
+        bin.first->entries[bin.first->count++] = { object, reclaim_fn };
+        ++bin.count;
+        stats_add(stat_objects_retired, 1);
+
+        if (++record->limbo > limbo_limit)
+        {
+            if (try_advance(epoch))
+                ++epoch;
+
+            reclaim(record, epoch);
+        }
+    }
+
+    u64 epoch() const { return global_epoch.load(std::memory_order_acquire); }
+
+private:
+    static constexpr u64 offline_epoch = ~0ull;
+
+    struct limbo_entry_t {
+        void* object;
+        reclaim_fn_t reclaim_fn;
+    };
+
+    struct limbo_batch_t {
+        limbo_batch_t* next;
+        u64 epoch;
+        u32 count;
+        limbo_entry_t entries[batch_entries];
+    };
+
+    struct limbo_bin_t {
+        limbo_batch_t* first;
+        u64 epoch;
+        size_t count;
+    };
+
+    // announced and owned are read by every thread that tries to advance, the
+    // rest only by the owning thread
+    struct alignas(64) thread_record_t {
+        std::atomic<u64> announced;
+        std::atomic<bool> owned;
+
+        alignas(64) limbo_bin_t bins[3];
+        limbo_batch_t* spare;
+        u32 spare_count;
+        size_t limbo;
+    };
+
+    // constant initialized like the stats registry, objects can be retired
+    // from other static constructors
+    std::atomic<u64> global_epoch;
+    std::atomic<u32> record_top;
+    thread_record_t records[max_epoch_threads];
+
+    // batches of threads that exited or never got a record, reclaimed by
+    // whichever thread announces next
+    std::atomic<limbo_batch_t*> orphans;
+
+    static inline thread_local thread_record_t* local = nullptr;
+    static inline thread_local bool detached = false;
+
+    friend struct epoch_thread_exit_t;
+
+    FORCE_INLINE thread_record_t* local_record()
+    {
+        thread_record_t* record = local;
+        return record || detached ? record : attach();
+    }
+
+    NO_INLINE thread_record_t* attach()
+    {
+        for (;;)
+        {
+            u32 top = record_top.load(std::memory_order_acquire);
+
+            for (u32 i = 0; i < top; ++i)
+            {
+                bool expected = false;
+
+                if (!records[i].owned.load(std::memory_order_relaxed) &&
+                    records[i].owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                {
+                    thread_record_t* record = &records[i];
+                    record->announced.store(global_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+
+                    local = record;
+                    epoch_thread_exit.owner = this;
+                    return record;
+                }
+            }
+
+            // threads past the limit get no record, they don't hold the epoch
+            // back and hand everything they retire to the orphans
+            if (top == max_epoch_threads)
+            {
+                detached = true;
+                return nullptr;
+            }
+
+            record_top.compare_exchange_weak(top, top + 1, std::memory_order_release);
+        }
+    }
+
+    // the limbo lists go to the orphans, the record to the next thread
+    void detach()
+    {
+        thread_record_t* record = local;
+
+        record->announced.store(offline_epoch, std::memory_order_seq_cst);
+
+        for (limbo_bin_t& bin : record->bins)
+        {
+            for (limbo_batch_t* batch = bin.first; batch;)
+            {
+                limbo_batch_t* next = batch->next;
+                batch->epoch = bin.epoch;
+                push_orphans(batch, batch);
+                batch = next;
+            }
+
+            bin = limbo_bin_t{};
+        }
+
+        while (limbo_batch_t* batch = record->spare)
+        {
+            record->spare = batch->next;
+            heap_shards.local().free(batch);
+        }
+
+        record->spare_count = 0;
+        record->limbo = 0;
+
+        local = nullptr;
+        detached = true;
+        record->owned.store(false, std::memory_order_release);
+    }
+
+    // every online thread announced epoch, the first thread to see that moves
+    // the epoch on. a record that is being claimed counts as offline until its
+    // thread announced, which it does before it touches anything shared
+    bool try_advance(u64 epoch)
+    {
+        u32 top = record_top.load(std::memory_order_acquire);
+
+        for (u32 i = 0; i < top; ++i)
+        {
+            if (!records[i].owned.load(std::memory_order_seq_cst))
+                continue;
+
+            u64 announced = records[i].announced.load(std::memory_order_seq_cst);
+
+            if (announced != epoch && announced != offline_epoch)
+                return false;
+        }
+
+        return global_epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+    }
+
+    void reclaim(thread_record_t* record, u64 epoch)
+    {
+        for (limbo_bin_t& bin : record->bins)
+        {
+            if (bin.count && bin.epoch + 2 <= epoch)
+                reclaim_bin(record, bin);
+        }
+    }
+
+    // the bin is emptied first, a reclaim function may retire more objects
+    void reclaim_bin(thread_record_t* record, limbo_bin_t& bin)
+    {
+        limbo_batch_t* batch = bin.first;
+
+        record->limbo -= bin.count;
+        bin = limbo_bin_t{};
+
+        while (batch)
+        {
+            limbo_batch_t* next = batch->next;
+            reclaim_batch(batch);
+
+            if (record->spare_count < max_spare_batches)
+            {
+                batch->next = record->spare;
+                record->spare = batch;
+                ++record->spare_count;
+            }
+            else
+                heap_shards.local().free(batch);
+
+            batch = next;
+        }
+    }
+
+    // heap blocks are gathered and freed with one batch free, which takes the
+    // heap lock once for all of them that came from the local shard
+    static void reclaim_batch(limbo_batch_t* batch)
+    {
+        void* blocks[batch_entries];
+        u32 block_count = 0;
+
+        for (u32 i = 0; i < batch->count; ++i)
+        {
+            limbo_entry_t& entry = batch->entries[i];
+
+            if (entry.reclaim_fn)
+                entry.reclaim_fn(entry.object);
+            else
+                blocks[block_count++] = entry.object;
+        }
+
+        if (block_count)
+            heap_shards.local().free_batch(blocks, block_count);
+
+        stats_add(stat_objects_reclaimed, batch->count);
+        batch->count = 0;
+    }
+
+    limbo_batch_t* new_batch(thread_record_t* record)
+    {
+        limbo_batch_t* batch = record->spare;
+
+        if (batch)
+        {
+            record->spare = batch->next;
+            --record->spare_count;
+        }
+        else if (!(batch = static_cast<limbo_batch_t*>(heap_shards.local().allocate(sizeof(limbo_batch_t)))))
+            return nullptr;
+
+        batch->next = nullptr;
+        batch->count = 0;
+        return batch;
+    }
+
+    // a single entry batch of its own, the slow path of threads without a
+    // record
+    void retire_orphan(void* object, reclaim_fn_t reclaim_fn, u64 epoch)
+    {
+        auto* batch = static_cast<limbo_batch_t*>(heap_shards.local().allocate(offsetof(limbo_batch_t, entries) + sizeof(limbo_entry_t)));
+        if (!batch)
+            return;
+
+        batch->epoch = epoch;
+        batch->count = 1;
+        batch->entries[0] = { object, reclaim_fn };
+        stats_add(stat_objects_retired, 1);
+        push_orphans(batch, batch);
+    }
+
+    void push_orphans(limbo_batch_t* first, limbo_batch_t* last)
+    {
+        limbo_batch_t* top = orphans.load(std::memory_order_relaxed);
+
+        do
+        {
+            last->next = top;
+        } while (!orphans.compare_exchange_weak(top, first, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // the list is taken whole, the batches that aren't safe yet go back
+    void reclaim_orphans(u64 epoch)
+    {
+        limbo_batch_t* batch = orphans.exchange(nullptr, std::memory_order_acquire);
+        limbo_batch_t* keep_first = nullptr;
+        limbo_batch_t* keep_last = nullptr;
+
+        while (batch)
+        {
+            limbo_batch_t* next = batch->next;
+
+            if (batch->epoch + 2 <= epoch)
+            {
+                reclaim_batch(batch);
+                heap_shards.local().free(batch);
+            }
+            else
+            {
+                batch->next = keep_first;
+                keep_first = batch;
+                keep_last = keep_last ? keep_last : batch;
+            }
+
+            batch = next;
+        }
+
+        if (keep_first)
+            push_orphans(keep_first, keep_last);
+    }
+};
+
+inline epoch_reclaimer_t epoch_reclaimer;
+
+inline epoch_thread_exit_t::~epoch_thread_exit_t()
+{
+    if (owner)
+        owner->detach();
+}
@@ -1,5 +1,8 @@
+
 #pragma once
-#include "vmm.h"
+#include "numa_pools.h"
+#include "tags.h"
+#include <atomic>
 
 class heap_allocator_t
 {
@@ -19,41 +22,208 @@ public:
     static constexpr size_t default_page_size = 64 * 1024;
     static constexpr size_t block_align_granule = 16;
 
+    // sizes up to small_size_limit get an exact bin per granule step, above that
+    // every power of two is split into 1 << log_bin_bits bins. anything past
+    // large_size_threshold skips the heap and goes straight to the memory pool.
+    static constexpr size_t small_size_limit = 2048;
+    static constexpr size_t large_size_threshold = 256 * 1024;
+    static constexpr size_t small_bin_count = small_size_limit / block_align_granule;
+    static constexpr size_t log_bin_bits = 2;
+    static constexpr size_t log_bin_count = 40;
+    static constexpr size_t bin_count = small_bin_count + log_bin_count;
+    static constexpr size_t bin_words = (bin_count + 63) / 64;
+
     void initialize()
     {
         if (mem_pool)
             return;
 
-        mem_pool = &memory_pool;
+        mem_pool = &numa_pools;
         page_list = nullptr;
+        spare_page = nullptr;
+        large_list = nullptr;
     }
 
-    void* allocate(size_t raw_size)
+    void* allocate(size_t raw_size, u32 tag = current_memory_tag())
     {
-        pltf_lock_guard lock(heap_lock);
-        size_t size = align_up(raw_size, block_align_granule);
+        size_t size = align_up(raw_size ? raw_size : 1, block_align_granule);
+        void* ptr;
 
-        for (page_header_t* pg = page_list; pg; pg = pg->next)
+        if (!memory_budgets.admit(tag, size))
+            return nullptr;
+
+        if (size > large_size_threshold)
+            ptr = allocate_large(size, block_align_granule);
+        else
         {
-            if (void* p = allocate_in_page(pg, size))
-                return p;
+            stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+
+            if (remote_frees.load(std::memory_order_relaxed))
+                drain_remote_frees();
+
+            ptr = allocate_locked(size);
         }
 
-        page_header_t* pg = allocate_new_page(max(size + sizeof(block_header_t), default_page_size));
-        if (!pg) return nullptr;
-        return allocate_in_page(pg, size);
+        return account_alloc(ptr, tag);
     }
 
-    void  free(void* ptr)
+    // payload aligned to align bytes, a power of two. the block is carved out
+    // of a free block big enough for the worst case padding and the gap in
+    // front of it goes back to the bins as a block of its own, so the result
+    // frees like any other block. realloc only keeps the default alignment
+    void* allocate_aligned(size_t raw_size, size_t align, u32 tag = current_memory_tag())
     {
-        pltf_lock_guard lock(heap_lock);
+        if (align <= block_align_granule)
+            return allocate(raw_size, tag);
+
+        if (align & (align - 1) || align > max_block_align)
+            return nullptr;
+
+        size_t size = align_up(raw_size ? raw_size : 1, block_align_granule);
+        size_t padded = size + align + min_block_size;
 
+        if (!memory_budgets.admit(tag, size))
+            return nullptr;
+
+        void* ptr = padded > large_size_threshold ? allocate_large(size, align) : allocate_aligned_small(size, padded, align);
+        return account_alloc(ptr, tag);
+    }
+
+    // a remote free is counted by the thread that frees, not by the owner
+    // that later bins the block
+    void  free(void* ptr)
+    {
         if (!ptr)
             return;
 
-        auto* bh = reinterpret_cast<block_header_t*>((char*)ptr - sizeof(block_header_t));
-        bh->used = false;
-        coalesce(bh);
+        auto* bh = header(ptr);
+        memory_budgets.count_free(bh->size(), bh->tag);
+        release_block(ptr);
+    }
+
+    // fills out with up to count blocks of raw_size bytes under a single lock
+    // acquisition, returns how many were allocated
+    size_t allocate_batch(size_t raw_size, size_t count, void** out, u32 tag = current_memory_tag())
+    {
+        if (!memory_budgets.admit(tag, align_up(raw_size ? raw_size : 1, block_align_granule) * count))
+            return 0;
+
+        size_t done = allocate_blocks(raw_size, count, out);
+
+        for (size_t i = 0; i < done; ++i)
+            account_alloc(out[i], tag);
+
+        return done;
+    }
+
+    void free_batch(void** ptrs, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (ptrs[i])
+                memory_budgets.count_free(header(ptrs[i])->size(), header(ptrs[i])->tag);
+        }
+
+        free_blocks(ptrs, count);
+    }
+
+    // the batch calls without the stats, for front ends that keep blocks of
+    // their own (heap_tcache_t) and count them when they reach the caller
+    size_t allocate_blocks(size_t raw_size, size_t count, void** out)
+    {
+        size_t size = align_up(raw_size ? raw_size : 1, block_align_granule);
+        size_t done = 0;
+
+        if (size > large_size_threshold)
+        {
+            for (; done < count; ++done)
+            {
+                if (!(out[done] = allocate_large(size, block_align_granule)))
+                    break;
+            }
+
+            return done;
+        }
+
+        stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+
+        if (remote_frees.load(std::memory_order_relaxed))
+            drain_remote_frees();
+
+        for (; done < count; ++done)
+        {
+            if (!(out[done] = allocate_locked(size)))
+                break;
+        }
+
+        return done;
+    }
+
+    // blocks of other heaps, which a thread cache ends up holding after frees
+    // across heaps, go back to their owners one by one after this heap's own
+    // blocks, a heap never takes another heap's lock while holding its own.
+    // the owners are all looked up first, once a block is freed its page may
+    // already be gone
+    void free_blocks(void** ptrs, size_t count)
+    {
+        for (size_t start = 0; start < count; start += 64)
+        {
+            void** chunk = ptrs + start;
+            size_t n = count - start < 64 ? count - start : 64;
+            u64 foreign = 0;
+            size_t own = 0;
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (!chunk[i])
+                    continue;
+
+                if (owner_of(header(chunk[i])) != this)
+                    foreign |= 1ull << i;
+                else
+                    ++own;
+            }
+
+            if (own)
+                free_own_blocks(chunk, n, foreign);
+
+            for (; foreign; foreign &= foreign - 1)
+                release_block(chunk[bit_scan_forward(foreign)]);
+        }
+    }
+
+    // frees coming from a thread other than the owner are parked on a lock
+    // free list and only returned to the bins by the owner, either on its next
+    // allocation or through collect(). a heap without an owner is shared and
+    // frees directly from any thread
+    void bind(u64 thread_id)
+    {
+        owner_thread = thread_id;
+    }
+
+    void collect()
+    {
+        if (!remote_frees.load(std::memory_order_relaxed))
+            return;
+
+        stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+        drain_remote_frees();
+    }
+
+    static size_t usable_size(void* ptr)
+    {
+        return ptr ? header(ptr)->size() : 0;
+    }
+
+    static u32 tag_of(void* ptr)
+    {
+        return header(ptr)->tag;
+    }
+
+    // only the thread holding the block may retag it
+    static void set_tag(void* ptr, u32 tag)
+    {
+        header(ptr)->tag = tag;
     }
 
     void* realloc(void* ptr, size_t new_size)
@@ -67,224 +237,708 @@ public:
             return nullptr;
         }
 
-        heap_lock.lock_exclusive();
-        auto* bh = reinterpret_cast<block_header_t*>((char*)ptr - sizeof(block_header_t));
-        size_t old_sz = bh->size;
+        auto* bh = header(ptr);
+
+        if (heap_allocator_t* owner = owner_of(bh); owner != this)
+            return owner->realloc(ptr, new_size);
+
+        size_t old_sz = bh->size();
         size_t need = align_up(new_size, block_align_granule);
-      
-        if (need <= old_sz)
+        u32 tag = bh->tag;
+
+        if (need > old_sz && !memory_budgets.admit(tag, need - old_sz))
+            return nullptr;
+
+        // resizing in place counts as a free of the old block and an
+        // allocation of the new one, the same as the moving path below. the
+        // block keeps its tag either way
+        if (bh->large())
         {
-            split_block(bh, need);
-            heap_lock.unlock_exclusive();
-            return ptr;
-        }
+            if (need > large_size_threshold)
+            {
+                void* moved = realloc_large(bh, need);
+                if (moved)
+                    count_resize(old_sz, need, tag);
 
-        if (!bh->next || !bh->next->used)
+                return moved;
+            }
+        }
+        else if (need <= large_size_threshold)
         {
-            size_t avail = bh->size + (bh->next ? sizeof(block_header_t) + bh->next->size : 0);
-            if (avail >= need)
+            stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+
+            if (need <= old_sz)
+            {
+                split_block(bh, need);
+                lock.unlock();
+
+                count_resize(old_sz, bh->size(), tag);
+                return ptr;
+            }
+
+            block_header_t* nxt = next_block(bh);
+            if (nxt && !nxt->used() && old_sz + sizeof(block_header_t) + nxt->size() >= need)
             {
-                if (bh->next)
-                {
-                    block_header_t* nxt = bh->next;
-                    bh->size += sizeof(block_header_t) + nxt->size;
-                    bh->next = nxt->next;
-                }
+                unlink_free(nxt);
+                absorb_next(bh);
 
                 split_block(bh, need);
-                bh->used = true;
-                heap_lock.unlock_exclusive();
+                lock.unlock();
+
+                count_resize(old_sz, bh->size(), tag);
                 return ptr;
             }
         }
 
-        heap_lock.unlock_exclusive();
-
-        void* newp = allocate(new_size);
+        void* newp = allocate(new_size, tag);
         if (!newp) return nullptr;
-        memcpy(newp, ptr, old_sz);
+        memcpy(newp, ptr, old_sz < need ? old_sz : need);
         free(ptr);
         return newp;
     }
 
-    void print_stats() 
+    void destroy()
     {
-        pltf_shared_guard lock(heap_lock);
+        stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
 
-        constexpr size_t page_size = 0x1000; 
-        size_t pages_count = 0, blocks_total = 0, blocks_used = 0;
-        size_t used_bytes = 0;
+        // blocks still live go down with their pages, they are counted as
+        // freed here. pending remote frees were counted when they were pushed
+        if (mem_pool && remote_frees.load(std::memory_order_relaxed))
+            drain_remote_frees();
 
-        for (page_header_t* pg = page_list; pg; pg = pg->next)
+        while (page_list)
         {
-            ++pages_count;
+            page_header_t* pg = page_list;
+            page_list = pg->next;
 
-            for (block_header_t* bh = pg->first; bh; bh = bh->next)
+            for (block_header_t* bh = first_block(pg); pg->live_blocks && bh; bh = next_block(bh))
             {
-                ++blocks_total;
-                if (bh->used)
-                {
-                    ++blocks_used;
-                    used_bytes += bh->size;
-                }
+                if (bh->used())
+                    memory_budgets.count_free(bh->size(), bh->tag);
             }
-        }
-
-        size_t committed_bytes = pages_count * page_size;
 
-        std::cout << "--- heap_allocator_t stats ---\n";
-        std::cout << " pages:        " << pages_count << "\n";
-        std::cout << " blocks total: " << blocks_total << "\n";
-        std::cout << " blocks used:  " << blocks_used << "\n";
-        std::cout << " committed:    " << (committed_bytes / (1024 * 1024)) << " MB\n";
-        std::cout << " used:         " << (used_bytes / (1024 * 1024.0)) << " MB\n";
-        std::cout << "------------------------------\n";
-    }
-
-    void destroy()
-    {
-        pltf_lock_guard lock(heap_lock);
+            if (mem_pool)
+                mem_pool->free(pg);
+        }
 
-        while (page_list)
+        while (large_list)
         {
-            page_header_t* pg = page_list;
-            page_list = pg->next;
+            large_header_t* lh = large_list;
+            large_list = lh->next;
+            auto* bh = reinterpret_cast<block_header_t*>(lh + 1);
+            memory_budgets.count_free(bh->size(), bh->tag);
 
-            if (mem_pool && pg->base)
-                mem_pool->free(pg->base);
+            if (mem_pool)
+                mem_pool->free(large_run(lh));
         }
 
+        for (size_t i = 0; i < bin_count; ++i)
+            bins[i] = nullptr;
+
+        for (size_t i = 0; i < bin_words; ++i)
+            bin_bitmap[i] = 0;
+
         page_list = nullptr;
+        spare_page = nullptr;
         mem_pool = nullptr;
+        remote_frees.store(nullptr, std::memory_order_relaxed);
     }
 
 
 private:
+    static constexpr size_t block_used = 1;
+    static constexpr size_t block_large = 2;
+    static constexpr size_t block_last = 4;
+    static constexpr size_t block_flags = block_align_granule - 1;
+
+    // boundary tagged: prev_size is the payload size of the physical
+    // predecessor so both neighbours of a block are reachable in O(1),
+    // page_offset leads back to the owning page header. tag is the memory tag
+    // of a used block, it shares a word with page_offset because no other
+    // thread reads that word while the block is in use, the holder can retag
+    // it without the lock
     struct block_header_t {
+        u32    prev_size;
+        u32    page_offset : 24;
+        u32    tag : 8;
+        size_t bits;
+
+        size_t size() const { return bits & ~block_flags; }
+        bool   used() const { return bits & block_used; }
+        bool   large() const { return bits & block_large; }
+    };
+
+    // free blocks keep their bin links in the payload, which is why the
+    // smallest block is one granule
+    struct free_links_t {
+        block_header_t* prev;
         block_header_t* next;
-        size_t       size;
-        bool         used;
     };
 
+    // owner is the heap the page belongs to, set once when the page is taken
+    // from the pool, so any heap can hand a block to the right one without a
+    // lock. both headers stay a multiple of the granule
     struct page_header_t {
-        page_header_t* next;
-        block_header_t* first;
-        void* base;
-        size_t        capacity;
+        page_header_t*    prev;
+        page_header_t*    next;
+        heap_allocator_t* owner;
+        u32               capacity;
+        u32               live_blocks;
+    };
+
+    struct alignas(16) large_header_t {
+        large_header_t*   prev;
+        large_header_t*   next;
+        heap_allocator_t* owner;
+    };
+
+    struct remote_free_t {
+        remote_free_t* next;
     };
 
-    virtual_memory_pool* mem_pool = nullptr;
+    // smallest block that can stand on its own, header plus one granule
+    static constexpr size_t min_block_size = sizeof(block_header_t) + block_align_granule;
+
+    // an aligned large block's offset into its run has to fit page_offset
+    static constexpr size_t max_block_align = 1 << 23;
+
+    numa_memory_pools_t* mem_pool = nullptr;
     page_header_t* page_list = nullptr;
-    pltf_mutex heap_lock;
+    page_header_t* spare_page = nullptr;
+    large_header_t* large_list = nullptr;
+    block_header_t* bins[bin_count] = {};
+    u64 bin_bitmap[bin_words] = {};
+    u64 owner_thread = 0;
+    std::atomic<remote_free_t*> remote_frees = nullptr;
+    pltf_spin_mutex heap_lock;
 
     static size_t align_up(size_t v, size_t a)
     {
         return (v + a - 1) & ~(a - 1);
     }
 
-    page_header_t* allocate_new_page(size_t want)
+    static void count_resize(size_t old_size, size_t new_size, u32 tag)
     {
-        void* raw = mem_pool->allocate(align_up(want + sizeof(page_header_t), default_page_size));
-        if (!raw)
+        memory_budgets.count_free(old_size, tag);
+        memory_budgets.count_alloc(new_size, tag);
+    }
+
+    static void* account_alloc(void* ptr, u32 tag)
+    {
+        if (ptr)
+        {
+            block_header_t* bh = header(ptr);
+            bh->tag = tag;
+            memory_budgets.count_alloc(bh->size(), tag);
+        }
+
+        return ptr;
+    }
+
+    static block_header_t* header(void* ptr) { return reinterpret_cast<block_header_t*>((char*)ptr - sizeof(block_header_t)); }
+    static void* payload(block_header_t* bh) { return (char*)bh + sizeof(block_header_t); }
+    static free_links_t* links(block_header_t* bh) { return reinterpret_cast<free_links_t*>(payload(bh)); }
+
+    static page_header_t* page_of(block_header_t* bh) { return reinterpret_cast<page_header_t*>((char*)bh - bh->page_offset); }
+    static block_header_t* first_block(page_header_t* pg) { return reinterpret_cast<block_header_t*>(pg + 1); }
+
+    static heap_allocator_t* owner_of(block_header_t* bh)
+    {
+        if (bh->large())
+            return (reinterpret_cast<large_header_t*>(bh) - 1)->owner;
+
+        return page_of(bh)->owner;
+    }
+
+    static block_header_t* next_block(block_header_t* bh)
+    {
+        if (bh->bits & block_last)
+            return nullptr;
+
+        return reinterpret_cast<block_header_t*>((char*)payload(bh) + bh->size());
+    }
+
+    static block_header_t* prev_block(block_header_t* bh)
+    {
+        if (bh->page_offset == sizeof(page_header_t))
+            return nullptr;
+
+        return reinterpret_cast<block_header_t*>((char*)bh - bh->prev_size - sizeof(block_header_t));
+    }
+
+    // merges the physical successor into bh, the successor must already be out of its bin
+    static void absorb_next(block_header_t* bh)
+    {
+        block_header_t* nxt = next_block(bh);
+        bh->bits += sizeof(block_header_t) + nxt->size();
+        bh->bits |= nxt->bits & block_last;
+
+        if (block_header_t* after = next_block(bh))
+            after->prev_size = (u32)bh->size();
+    }
+
+    static size_t bin_index(size_t size)
+    {
+        if (size <= small_size_limit)
+            return size / block_align_granule - 1;
+
+        u32 msb = bit_scan_reverse(size);
+        size_t sub = (size >> (msb - log_bin_bits)) & ((1ull << log_bin_bits) - 1);
+        size_t index = small_bin_count + ((msb - bit_scan_reverse(small_size_limit)) << log_bin_bits) + sub;
+
+        return index < bin_count ? index : bin_count - 1;
+    }
+
+    void insert_free(block_header_t* bh)
+    {
+        size_t index = bin_index(bh->size());
+        free_links_t* l = links(bh);
+
+        l->prev = nullptr;
+        l->next = bins[index];
+
+        if (bins[index])
+            links(bins[index])->prev = bh;
+
+        bins[index] = bh;
+        bin_bitmap[index / 64] |= 1ull << (index % 64);
+    }
+
+    void unlink_free(block_header_t* bh)
+    {
+        size_t index = bin_index(bh->size());
+        free_links_t* l = links(bh);
+
+        if (l->prev)
+            links(l->prev)->next = l->next;
+        else
+            bins[index] = l->next;
+
+        if (l->next)
+            links(l->next)->prev = l->prev;
+
+        if (!bins[index])
+            bin_bitmap[index / 64] &= ~(1ull << (index % 64));
+    }
+
+    size_t find_free_bin(size_t start)
+    {
+        for (size_t word = start / 64; word < bin_words; ++word)
+        {
+            u64 mask = bin_bitmap[word];
+
+            if (word == start / 64)
+                mask &= ~0ull << (start % 64);
+
+            if (mask)
+                return word * 64 + bit_scan_forward(mask);
+        }
+
+        return bin_count;
+    }
+
+    // the head of the request's own bin may be too small for log spaced bins,
+    // every block in a higher bin is guaranteed to fit
+    block_header_t* take_free_block(size_t size)
+    {
+        size_t index = bin_index(size);
+        block_header_t* bh = bins[index];
+
+        if (!bh || bh->size() < size)
+        {
+            index = find_free_bin(index + 1);
+            if (index == bin_count)
+                return nullptr;
+
+            bh = bins[index];
+        }
+
+        unlink_free(bh);
+        return bh;
+    }
+
+    block_header_t* allocate_new_page(size_t want)
+    {
+        size_t bytes = align_up(want + sizeof(page_header_t), default_page_size);
+
+        auto* pg = reinterpret_cast<page_header_t*>(mem_pool->allocate(bytes));
+        if (!pg)
             return nullptr;
 
-        auto* pg = reinterpret_cast<page_header_t*>(raw);
-        pg->base = raw;
+        pg->prev = nullptr;
         pg->next = page_list;
-        pg->capacity = align_up(want + sizeof(page_header_t), default_page_size) - sizeof(page_header_t);
+        pg->owner = this;
+        pg->capacity = (u32)(bytes - sizeof(page_header_t));
+        pg->live_blocks = 0;
+
+        if (page_list)
+            page_list->prev = pg;
         page_list = pg;
 
-        auto* bh = reinterpret_cast<block_header_t*>((char*)raw + sizeof(page_header_t));
-        bh->next = nullptr;
-        bh->size = pg->capacity - sizeof(block_header_t);
-        bh->used = false;
-        pg->first = bh;
+        block_header_t* bh = first_block(pg);
+        bh->prev_size = 0;
+        bh->page_offset = sizeof(page_header_t);
+        bh->bits = (pg->capacity - sizeof(block_header_t)) | block_last;
 
-        return pg;
+        insert_free(bh);
+        return bh;
     }
 
-    void* allocate_in_page(page_header_t* pg, size_t size)
+    // an emptied page is kept around as a spare so a heap oscillating around a
+    // page boundary does not commit and decommit on every call. returns true
+    // when the page was handed back to the pool
+    bool release_page(page_header_t* pg)
     {
-        for (block_header_t* bh = pg->first; bh; bh = bh->next)
+        if (!spare_page)
         {
-            if (!bh->used && bh->size >= size)
+            spare_page = pg;
+            return false;
+        }
+
+        if (pg->prev)
+            pg->prev->next = pg->next;
+        else
+            page_list = pg->next;
+
+        if (pg->next)
+            pg->next->prev = pg->prev;
+
+        mem_pool->free(pg);
+        return true;
+    }
+
+    // frees the blocks of up to 64 that are not flagged in skip, all of them
+    // owned by this heap
+    void free_own_blocks(void** ptrs, size_t count, u64 skip)
+    {
+        if (owner_thread && owner_thread != pltf_thread_id())
+        {
+            for (size_t i = 0; i < count; ++i)
             {
-                split_block(bh, size);
-                bh->used = true;
-                return (char*)bh + sizeof(block_header_t);
+                if (ptrs[i] && !(skip >> i & 1))
+                    push_remote_free(ptrs[i]);
             }
+
+            return;
+        }
+
+        stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!ptrs[i] || skip >> i & 1)
+                continue;
+
+            auto* bh = header(ptrs[i]);
+
+            if (bh->large())
+                mem_pool->free(large_run(unlink_large(bh)));
+            else
+                free_locked(bh);
         }
-        return nullptr;
     }
 
-    void split_block(block_header_t* bh, size_t want)
+    // hands a block back to the heap that owns it without counting it
+    void release_block(void* ptr)
     {
-        if (bh->size >= want + sizeof(block_header_t) + block_align_granule)
+        auto* bh = header(ptr);
+
+        if (heap_allocator_t* owner = owner_of(bh); owner != this)
         {
-            auto* tail = reinterpret_cast<block_header_t*>(
-                (char*)bh + sizeof(block_header_t) + want
-                );
-            tail->size = bh->size - want - sizeof(block_header_t);
-            tail->used = false;
-            tail->next = bh->next;
+            owner->release_block(ptr);
+            return;
+        }
+
+        if (owner_thread && owner_thread != pltf_thread_id())
+        {
+            push_remote_free(ptr);
+            return;
+        }
 
-            bh->size = want;
-            bh->next = tail;
+        if (bh->large())
+        {
+            free_large(bh);
+            return;
         }
+
+        stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+        free_locked(bh);
+    }
+
+    void push_remote_free(void* ptr)
+    {
+        auto* node = static_cast<remote_free_t*>(ptr);
+        remote_free_t* head = remote_frees.load(std::memory_order_relaxed);
+
+        do {
+            node->next = head;
+        } while (!remote_frees.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
     }
 
-    void coalesce(block_header_t* freed)
+    // consumers take the whole list with one exchange, so there is no ABA on pop
+    void drain_remote_frees()
     {
-        if (freed->next && !freed->next->used)
+        remote_free_t* node = remote_frees.exchange(nullptr, std::memory_order_acquire);
+
+        while (node)
         {
-            freed->size += sizeof(block_header_t) + freed->next->size;
-            freed->next = freed->next->next;
+            remote_free_t* next = node->next;
+            auto* bh = header(node);
+
+            if (bh->large())
+                mem_pool->free(large_run(unlink_large(bh)));
+            else
+                free_locked(bh);
+
+            node = next;
         }
+    }
+
+    void* allocate_locked(size_t size)
+    {
+        block_header_t* bh = take_free_block(size);
 
-        for (page_header_t* pg = page_list; pg; pg = pg->next)
+        if (!bh)
         {
-            block_header_t* prev = nullptr;
-            for (block_header_t* bh = pg->first; bh; bh = bh->next)
-            {
-                if (bh == freed)
-                {
-                    if (prev && !prev->used)
-                    {
-                        prev->size += sizeof(block_header_t) + freed->size;
-                        prev->next = freed->next;
-                        freed = prev;
-                    }
-                    break;
-                }
-                prev = bh;
-            }
+            size_t want = size + sizeof(block_header_t);
+            bh = allocate_new_page(want > default_page_size ? want : default_page_size);
+            if (!bh) return nullptr;
+
+            unlink_free(bh);
+        }
+
+        page_header_t* pg = page_of(bh);
+        if (pg->live_blocks++ == 0 && pg == spare_page)
+            spare_page = nullptr;
+
+        bh->bits |= block_used;
+        split_block(bh, size);
+        return payload(bh);
+    }
+
+    void free_locked(block_header_t* bh)
+    {
+        page_header_t* pg = page_of(bh);
+
+        bh->bits &= ~block_used;
+        bh = coalesce(bh);
+
+        if (--pg->live_blocks == 0 && release_page(pg))
+            return;
+
+        insert_free(bh);
+    }
+
+    void* allocate_aligned_small(size_t size, size_t padded, size_t align)
+    {
+        stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+
+        if (remote_frees.load(std::memory_order_relaxed))
+            drain_remote_frees();
+
+        block_header_t* bh = take_free_block(padded);
+
+        if (!bh)
+        {
+            size_t want = padded + sizeof(block_header_t);
+            bh = allocate_new_page(want > default_page_size ? want : default_page_size);
+            if (!bh) return nullptr;
+
+            unlink_free(bh);
+        }
+
+        bh = split_front(bh, align);
+
+        page_header_t* pg = page_of(bh);
+        if (pg->live_blocks++ == 0 && pg == spare_page)
+            spare_page = nullptr;
+
+        bh->bits |= block_used;
+        split_block(bh, size);
+        return payload(bh);
+    }
+
+    // large blocks don't live in a page, their page_offset is the distance
+    // from the start of the pool run to the large header instead, which is
+    // only non zero when the payload had to be pushed up for alignment
+    void* allocate_large(size_t size, size_t align)
+    {
+        // runs start on a pool page, so up to page alignment the offset is
+        // known up front. past that only the granule the run's payload
+        // already has is given
+        size_t prefix = sizeof(large_header_t) + sizeof(block_header_t);
+        size_t padding = align <= _page_size ? align_up(prefix, align) - prefix : align - block_align_granule;
+
+        char* raw = static_cast<char*>(mem_pool->allocate(padding + prefix + size));
+        if (!raw)
+            return nullptr;
+
+        size_t offset = (align_up(reinterpret_cast<size_t>(raw) + prefix, align) - prefix) - reinterpret_cast<size_t>(raw);
+
+        auto* lh = reinterpret_cast<large_header_t*>(raw + offset);
+        auto* bh = reinterpret_cast<block_header_t*>(lh + 1);
+        bh->prev_size = 0;
+        bh->page_offset = (u32)offset;
+        bh->bits = size | block_used | block_large;
+
+        lh->owner = this;
+
+        stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+        link_large(lh);
+
+        return payload(bh);
+    }
+
+    void link_large(large_header_t* lh)
+    {
+        lh->prev = nullptr;
+        lh->next = large_list;
+        if (large_list)
+            large_list->prev = lh;
+        large_list = lh;
+    }
+
+    static void* large_run(large_header_t* lh)
+    {
+        return (char*)lh - reinterpret_cast<block_header_t*>(lh + 1)->page_offset;
+    }
+
+    large_header_t* unlink_large(block_header_t* bh)
+    {
+        auto* lh = reinterpret_cast<large_header_t*>(bh) - 1;
+
+        if (lh->prev)
+            lh->prev->next = lh->next;
+        else
+            large_list = lh->next;
+
+        if (lh->next)
+            lh->next->prev = lh->prev;
+
+        return lh;
+    }
+
+    void free_large(block_header_t* bh)
+    {
+        large_header_t* lh;
+
+        {
+            stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+            lh = unlink_large(bh);
+        }
+
+        mem_pool->free(large_run(lh));
+    }
+
+    // the block is off the large list while the pool resizes it, the heap
+    // lock isn't held across a copy that can run to megabytes
+    void* realloc_large(block_header_t* bh, size_t need)
+    {
+        size_t offset = bh->page_offset;
+        large_header_t* lh;
+
+        {
+            stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+            lh = unlink_large(bh);
+        }
+
+        void* run = mem_pool->realloc(large_run(lh), offset + sizeof(large_header_t) + sizeof(block_header_t) + need);
+        auto* moved = run ? reinterpret_cast<large_header_t*>((char*)run + offset) : lh;
+
+        if (run)
+        {
+            bh = reinterpret_cast<block_header_t*>(moved + 1);
+            bh->bits = need | block_used | block_large;
         }
 
-        for (page_header_t* pg = page_list, *prev_pg = nullptr; pg; prev_pg = pg, pg = pg->next)
+        stats_lock_guard lock(heap_lock, PLTF_LOCK_SITE("heap_lock"));
+        link_large(moved);
+
+        return run ? payload(bh) : nullptr;
+    }
+
+    // moves the start of the free block bh up until its payload is aligned to
+    // align, the skipped bytes stay behind as a free block of their own. the
+    // gap is either empty or at least min_block_size
+    block_header_t* split_front(block_header_t* bh, size_t align)
+    {
+        size_t start = reinterpret_cast<size_t>(payload(bh));
+        size_t aligned = align_up(start, align);
+
+        if (aligned == start)
+            return bh;
+
+        while (aligned - start < min_block_size)
+            aligned += align;
+
+        size_t gap = aligned - start;
+        auto* moved = reinterpret_cast<block_header_t*>(aligned - sizeof(block_header_t));
+
+        moved->prev_size = (u32)(gap - sizeof(block_header_t));
+        moved->page_offset = bh->page_offset + (u32)gap;
+        moved->bits = (bh->size() - gap) | (bh->bits & block_last);
+
+        bh->bits = (gap - sizeof(block_header_t)) | (bh->bits & (block_flags & ~block_last));
+
+        if (block_header_t* nxt = next_block(moved))
+            nxt->prev_size = (u32)moved->size();
+
+        insert_free(bh);
+        return moved;
+    }
+
+    // carves the tail off bh when it is big enough to hold a block of its own,
+    // the tail is merged with a free successor before being binned
+    void split_block(block_header_t* bh, size_t want)
+    {
+        if (bh->size() >= want + sizeof(block_header_t) + block_align_granule)
         {
-            bool all_free = true;
-            for (block_header_t* bh = pg->first; bh; bh = bh->next)
+            auto* tail = reinterpret_cast<block_header_t*>(
+                (char*)bh + sizeof(block_header_t) + want
+                );
+            tail->prev_size = (u32)want;
+            tail->page_offset = bh->page_offset + (u32)(sizeof(block_header_t) + want);
+            tail->bits = (bh->size() - want - sizeof(block_header_t)) | (bh->bits & block_last);
+
+            bh->bits = want | (bh->bits & (block_flags & ~block_last));
+
+            block_header_t* nxt = next_block(tail);
+            if (nxt && !nxt->used())
             {
-                if (bh->used)
-                {
-                    all_free = false;
-                    break;
-                }
+                unlink_free(nxt);
+                absorb_next(tail);
             }
-
-            if (all_free)
+            else if (nxt)
             {
-                if (prev_pg)
-                    prev_pg->next = pg->next;
-                else
-                    page_list = pg->next;
-
-                mem_pool->free(pg->base);
-                return;
+                nxt->prev_size = (u32)tail->size();
             }
+
+            insert_free(tail);
+        }
+    }
+
+    // merges a freed block with free neighbours on both sides, the result is
+    // not binned yet
+    block_header_t* coalesce(block_header_t* freed)
+    {
+        block_header_t* nxt = next_block(freed);
+        if (nxt && !nxt->used())
+        {
+            unlink_free(nxt);
+            absorb_next(freed);
         }
+
+        block_header_t* prv = prev_block(freed);
+        if (prv && !prv->used())
+        {
+            unlink_free(prv);
+            absorb_next(prv);
+            freed = prv;
+        }
+
+        return freed;
     }
 
 };
 
-inline heap_allocator_t general_heap;
\ No newline at end of file
+inline heap_allocator_t general_heap;
@@ -0,0 +1,127 @@
+#pragma once
+#include "heap.h"
+#include <new>
+
+// the general heap split into independent shards, every shard a
+// heap_allocator_t with its own lock, pages and bins, so threads allocating
+// at the same time don't all queue up on one heap lock. a thread allocates
+// from the shard it is assigned to, frees and reallocs go to the shard that
+// owns the block whichever thread they come from. shard 0 is general_heap, a
+// single shard is the plain general heap.
+//
+// threads are assigned round robin on their first allocation, or by the
+// processor they run on at the time of every call. shards are created when
+// the count grows and never go away, a shard past a smaller count keeps its
+// blocks until they are freed
+enum heap_shard_mode_t : u32 {
+    heap_shard_round_robin,
+    heap_shard_by_cpu
+};
+
+class heap_shards_t
+{
+public:
+    static constexpr u32 max_shards = 64;
+
+    // a count of 0 is one shard per core. returns the count in use, which is
+    // less than asked for when a shard could not be created. threads move to
+    // the new layout on their next allocation
+    u32 configure(u32 count, heap_shard_mode_t mode)
+    {
+        pltf_lock_guard lock(config_lock, PLTF_LOCK_SITE("heap_shards"));
+        return configure_locked(count, mode);
+    }
+
+    FORCE_INLINE heap_allocator_t& local()
+    {
+        heap_allocator_t* shard = local_shard;
+
+        if (shard && local_generation == generation.load(std::memory_order_acquire))
+            return *shard;
+
+        return assign();
+    }
+
+    void collect()
+    {
+        u32 count = shard_count.load(std::memory_order_acquire);
+
+        for (u32 i = 0; i < count; ++i)
+            shards[i].load(std::memory_order_acquire)->collect();
+    }
+
+    u32 count() const { return shard_count.load(std::memory_order_acquire); }
+
+private:
+    std::atomic<heap_allocator_t*> shards[max_shards] = { &general_heap };
+    std::atomic<u32> shard_count{ 1 };
+    std::atomic<u32> shard_mode{ heap_shard_round_robin };
+    std::atomic<u32> next_shard{ 0 };
+
+    // 0 until the first configure, bumped by every one after it
+    std::atomic<u32> generation{ 0 };
+    pltf_spin_mutex config_lock;
+
+    static inline thread_local heap_allocator_t* local_shard = nullptr;
+    static inline thread_local u32 local_generation = 0;
+
+    u32 configure_locked(u32 count, heap_shard_mode_t mode)
+    {
+        if (!count)
+            count = pltf_cpu_count();
+
+        if (count > max_shards)
+            count = max_shards;
+
+        for (u32 i = 1; i < count; ++i)
+        {
+            if (shards[i].load(std::memory_order_relaxed))
+                continue;
+
+            void* mem = general_heap.allocate(sizeof(heap_allocator_t), default_memory_tag);
+            if (!mem)
+            {
+                count = i;
+                break;
+            }
+
+            shards[i].store(new (mem) heap_allocator_t(), std::memory_order_release);
+        }
+
+        shard_mode.store(mode, std::memory_order_relaxed);
+        shard_count.store(count, std::memory_order_release);
+        generation.fetch_add(1, std::memory_order_release);
+        return count;
+    }
+
+    // the by cpu mode comes through here on every call, local_shard stays
+    // null for it
+    NO_INLINE heap_allocator_t& assign()
+    {
+        u32 current = generation.load(std::memory_order_acquire);
+
+        if (!current)
+        {
+            pltf_lock_guard lock(config_lock, PLTF_LOCK_SITE("heap_shards"));
+
+            if (!generation.load(std::memory_order_relaxed))
+                configure_locked(0, heap_shard_round_robin);
+
+            current = generation.load(std::memory_order_acquire);
+        }
+
+        u32 count = shard_count.load(std::memory_order_acquire);
+        local_generation = current;
+
+        if (shard_mode.load(std::memory_order_relaxed) == heap_shard_by_cpu)
+        {
+            local_shard = nullptr;
+            return *shards[pltf_current_cpu() % count].load(std::memory_order_acquire);
+        }
+
+        local_shard = shards[next_shard.fetch_add(1, std::memory_order_relaxed) % count].load(std::memory_order_acquire);
+        return *local_shard;
+    }
+};
+
+inline heap_shards_t heap_shards;
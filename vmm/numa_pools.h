@@ -0,0 +1,174 @@
+#pragma once
+#include "vmm.h"
+#include <new>
+
+// the memory pool split by numa node: a virtual_memory_pool per node, each
+// with an address range of its own whose pages are placed on that node.
+// allocations come from the calling thread's node unless a node is asked for,
+// frees and reallocs go to the pool whose range holds the address. memory_pool
+// is node 0's pool, on a machine with a single node it is the only one and
+// nothing gets bound. the node pools are set up on first use and live as long
+// as the process
+class numa_memory_pools_t
+{
+public:
+    u32 count()
+    {
+        u32 nodes = node_count.load(std::memory_order_acquire);
+        return nodes ? nodes : setup();
+    }
+
+    virtual_memory_pool& local()
+    {
+        u32 nodes = count();
+        if (nodes == 1)
+            return memory_pool;
+
+        u32 node = pltf_current_numa_node();
+        return *pools[node < nodes ? node : 0].load(std::memory_order_acquire);
+    }
+
+    // nodes that don't exist fall back to the calling thread's node
+    virtual_memory_pool& node(u32 index)
+    {
+        if (index >= count())
+            return local();
+
+        return *pools[index].load(std::memory_order_acquire);
+    }
+
+    virtual_memory_pool& owner(const void* ptr)
+    {
+        u32 nodes = node_count.load(std::memory_order_acquire);
+
+        for (u32 i = 1; i < nodes; ++i)
+        {
+            virtual_memory_pool* pool = pools[i].load(std::memory_order_acquire);
+            if (pool->contains(ptr))
+                return *pool;
+        }
+
+        return memory_pool;
+    }
+
+    // a node that ran out of address space is passed over for the others
+    void* allocate(ul64 size)
+    {
+        virtual_memory_pool& preferred = local();
+
+        if (void* ptr = preferred.allocate(size))
+            return ptr;
+
+        u32 nodes = count();
+
+        for (u32 i = 0; i < nodes; ++i)
+        {
+            virtual_memory_pool* pool = pools[i].load(std::memory_order_acquire);
+            if (pool == &preferred)
+                continue;
+
+            if (void* ptr = pool->allocate(size))
+                return ptr;
+        }
+
+        return nullptr;
+    }
+
+    void free(void* ptr)
+    {
+        if (ptr)
+            owner(ptr).free(ptr);
+    }
+
+    void* realloc(void* ptr, ul64 new_size)
+    {
+        return ptr ? owner(ptr).realloc(ptr, new_size) : allocate(new_size);
+    }
+
+    void purge(bool all)
+    {
+        u32 nodes = count();
+
+        for (u32 i = 0; i < nodes; ++i)
+            pools[i].load(std::memory_order_acquire)->purge(all);
+    }
+
+    void set_decay(u32 decay_ms, ul64 retain_limit)
+    {
+        u32 nodes = count();
+
+        for (u32 i = 0; i < nodes; ++i)
+            pools[i].load(std::memory_order_acquire)->set_decay(decay_ms, retain_limit);
+    }
+
+    ul64 reserved_bytes()
+    {
+        u32 nodes = count();
+        ul64 bytes = 0;
+
+        for (u32 i = 0; i < nodes; ++i)
+            bytes += pools[i].load(std::memory_order_acquire)->reserved_bytes();
+
+        return bytes;
+    }
+
+    // the sum of every node's own peak, the nodes may have peaked at
+    // different times
+    ul64 committed_peak_bytes()
+    {
+        u32 nodes = count();
+        ul64 bytes = 0;
+
+        for (u32 i = 0; i < nodes; ++i)
+            bytes += pools[i].load(std::memory_order_acquire)->committed_peak_bytes();
+
+        return bytes;
+    }
+
+private:
+    std::atomic<virtual_memory_pool*> pools[max_numa_nodes] = { &memory_pool };
+    std::atomic<u32> node_count{ 0 };
+    pltf_spin_mutex setup_lock;
+
+    // the pool objects themselves live in node 0's pool. a node whose pool
+    // can't be set up ends the list, its threads use node 0
+    NO_INLINE u32 setup()
+    {
+        pltf_lock_guard lock(setup_lock, PLTF_LOCK_SITE("numa_pools"));
+
+        if (u32 nodes = node_count.load(std::memory_order_relaxed))
+            return nodes;
+
+        u32 nodes = pltf_numa_node_count();
+        if (nodes > max_numa_nodes)
+            nodes = max_numa_nodes;
+
+        if (nodes > 1)
+            memory_pool.bind_node(0);
+
+        u32 ready = 1;
+
+        for (; ready < nodes; ++ready)
+        {
+            void* mem = memory_pool.allocate(sizeof(virtual_memory_pool));
+            if (!mem)
+                break;
+
+            auto* pool = new (mem) virtual_memory_pool();
+
+            if (!pool->reserved_bytes())
+            {
+                memory_pool.free(mem);
+                break;
+            }
+
+            pool->bind_node(ready);
+            pools[ready].store(pool, std::memory_order_release);
+        }
+
+        node_count.store(ready, std::memory_order_release);
+        return ready;
+    }
+};
+
+inline numa_memory_pools_t numa_pools;
@@ -0,0 +1,173 @@
+#pragma once
+#include "vmm.h"
+#include <new>
+#include <utility>
+
+// fixed size slot allocator for objects that are created and destroyed in
+// bulk (entities, components). slots carry no header, a free slot stores the
+// next pointer of the free list in its own first bytes. slots are carved out
+// of slabs taken from the virtual_memory_pool, a fresh slab is handed out
+// with a bump pointer so its pages are only touched once they are used.
+// slabs are returned to the pool on destroy. a pool is owned by one thread
+// at a time, nothing here is locked
+class fixed_pool_t
+{
+public:
+    static constexpr size_t min_slab_size = 64 * 1024;
+    static constexpr size_t min_slab_slots = 16;
+
+    bool initialize(virtual_memory_pool* pool, size_t size, size_t align)
+    {
+        if (mem_pool)
+            return true;
+
+        if (align < alignof(free_slot_t))
+            align = alignof(free_slot_t);
+
+        if (align & (align - 1) || align > _page_size)
+            return false;
+
+        slot_align = align;
+        slot_size = (size < sizeof(free_slot_t) ? sizeof(free_slot_t) : size);
+        slot_size = (slot_size + align - 1) & ~(align - 1);
+
+        slab_size = (slot_size * min_slab_slots + sizeof(slab_header_t) + min_slab_size - 1) & ~(min_slab_size - 1);
+        mem_pool = pool;
+
+        return true;
+    }
+
+    void destroy()
+    {
+        if (!mem_pool)
+            return;
+
+        while (slabs)
+        {
+            slab_header_t* next = slabs->next;
+            mem_pool->free(slabs);
+            slabs = next;
+        }
+
+        free_list = nullptr;
+        bump = bump_end = nullptr;
+        live_slots = 0;
+        slab_count = 0;
+        mem_pool = nullptr;
+    }
+
+    FORCE_INLINE void* allocate()
+    {
+        if (free_slot_t* slot = free_list)
+        {
+            free_list = slot->next;
+            ++live_slots;
+            return slot;
+        }
+
+        if (bump == bump_end && !allocate_slab())
+            return nullptr;
+
+        void* slot = bump;
+        bump += slot_size;
+        ++live_slots;
+        return slot;
+    }
+
+    FORCE_INLINE void free(void* ptr)
+    {
+        if (!ptr)
+            return;
+
+        auto* slot = static_cast<free_slot_t*>(ptr);
+        slot->next = free_list;
+        free_list = slot;
+        --live_slots;
+    }
+
+    size_t size() const { return slot_size; }
+    size_t live() const { return live_slots; }
+    size_t reserved_bytes() const { return slab_count * slab_size; }
+
+private:
+    struct free_slot_t {
+        free_slot_t* next;
+    };
+
+    struct slab_header_t {
+        slab_header_t* next;
+    };
+
+    virtual_memory_pool* mem_pool = nullptr;
+    free_slot_t* free_list = nullptr;
+    char* bump = nullptr;
+    char* bump_end = nullptr;
+    slab_header_t* slabs = nullptr;
+
+    size_t slot_size = 0;
+    size_t slot_align = 0;
+    size_t slab_size = 0;
+    size_t slab_count = 0;
+    size_t live_slots = 0;
+
+    NO_INLINE bool allocate_slab()
+    {
+        auto* slab = static_cast<slab_header_t*>(mem_pool->allocate(slab_size));
+        if (!slab)
+            return false;
+
+        slab->next = slabs;
+        slabs = slab;
+        ++slab_count;
+
+        size_t first = (sizeof(slab_header_t) + slot_align - 1) & ~(slot_align - 1);
+        size_t slots = (slab_size - first) / slot_size;
+
+        bump = reinterpret_cast<char*>(slab) + first;
+        bump_end = bump + slots * slot_size;
+        return true;
+    }
+};
+
+// typed front end, create/destroy run the constructor and destructor in place
+template <typename T>
+class pool_allocator_t
+{
+public:
+    pool_allocator_t(virtual_memory_pool* pool = &memory_pool)
+    {
+        slots.initialize(pool, sizeof(T), alignof(T));
+    }
+
+    ~pool_allocator_t()
+    {
+        slots.destroy();
+    }
+
+    pool_allocator_t(const pool_allocator_t&) = delete;
+    pool_allocator_t& operator=(const pool_allocator_t&) = delete;
+
+    FORCE_INLINE T* allocate() { return static_cast<T*>(slots.allocate()); }
+    FORCE_INLINE void deallocate(T* ptr) { slots.free(ptr); }
+
+    template <typename... args_t>
+    FORCE_INLINE T* create(args_t&&... args)
+    {
+        void* mem = slots.allocate();
+        return mem ? new (mem) T(std::forward<args_t>(args)...) : nullptr;
+    }
+
+    FORCE_INLINE void destroy(T* ptr)
+    {
+        if (!ptr)
+            return;
+
+        ptr->~T();
+        slots.free(ptr);
+    }
+
+    size_t live() const { return slots.live(); }
+
+private:
+    fixed_pool_t slots;
+};
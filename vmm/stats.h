@@ -0,0 +1,278 @@
+#pragma once
+#include <datatypes.h>
+#include <bitops.h>
+#include <mtx.h>
+#include <atomic>
+#include <chrono>
+
+// process wide allocator counters. every thread writes a block of its own so
+// the hot paths never share a cache line and never take a lock, a snapshot
+// sums the blocks with relaxed loads. only the owning thread writes a block,
+// so a counter update is a plain load and store. threads past
+// max_stats_threads, and threads that already ran their exit destructors,
+// share the overflow block which is updated with fetch_add instead.
+//
+// counters only ever accumulate, a block that is handed to a new thread keeps
+// its values and the sums stay right. the few counters that go both ways
+// (retained pages, metadata bytes, pages per node) add wrapped negative
+// deltas, the unsigned sum over all blocks still comes out exact
+
+// allocation tags, see tags.h. every tag has a byte counter of its own
+constexpr u32 max_memory_tags = 64;
+
+// numa nodes the memory pool keeps apart, see numa_pools.h. every node has a
+// counter of the pages committed on it
+constexpr u32 max_numa_nodes = 16;
+
+// size classes for the per class op counters: class 0 is up to 16 bytes, every
+// class after it doubles, the last one takes everything past 256 KiB
+constexpr u32 stats_size_classes = 16;
+
+enum stat_t : u32 {
+    stat_bytes_allocated,
+    stat_bytes_freed,
+    stat_tcache_hits,
+    stat_pages_committed,
+    stat_pages_decommitted,
+    stat_metadata_bytes,
+    stat_retained_pages,
+    stat_purged_pages,
+    stat_lock_contentions,
+    stat_lock_wait_ns,
+    stat_objects_retired,
+    stat_objects_reclaimed,
+    stat_alloc_ops,
+    stat_free_ops = stat_alloc_ops + stats_size_classes,
+    stat_tag_bytes = stat_free_ops + stats_size_classes,
+    stat_node_pages = stat_tag_bytes + max_memory_tags,
+    stat_count = stat_node_pages + max_numa_nodes
+};
+
+struct alignas(64) thread_stats_t
+{
+    std::atomic<u64> counters[stat_count];
+
+    // per tag byte counts already folded into stats_registry_t::tag_usage,
+    // only ever touched by the owning thread
+    u64 tag_flushed[max_memory_tags];
+    std::atomic<bool> owned;
+};
+
+// constant initialized on purpose, allocations made from other static
+// constructors may count before any dynamic initializer of this file runs
+class stats_registry_t
+{
+public:
+    static constexpr u32 max_stats_threads = 256;
+
+    thread_stats_t* acquire()
+    {
+        for (;;)
+        {
+            u32 top = block_top.load(std::memory_order_acquire);
+
+            for (u32 i = 0; i < top; ++i)
+            {
+                bool expected = false;
+
+                if (!blocks[i].owned.load(std::memory_order_relaxed) &&
+                    blocks[i].owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                    return &blocks[i];
+            }
+
+            if (top == max_stats_threads)
+                return &overflow;
+
+            block_top.compare_exchange_weak(top, top + 1, std::memory_order_release);
+        }
+    }
+
+    void release(thread_stats_t* block)
+    {
+        if (block == &overflow)
+            return;
+
+        flush_tags(block);
+        block->owned.store(false, std::memory_order_release);
+    }
+
+    // folds whatever the block counted for tag since the last flush into
+    // tag_usage and returns the tag's usage after it
+    i64 flush_tag(thread_stats_t* block, u32 tag)
+    {
+        u64 bytes = block->counters[stat_tag_bytes + tag].load(std::memory_order_relaxed);
+        u64 pending = bytes - block->tag_flushed[tag];
+
+        block->tag_flushed[tag] = bytes;
+        return (i64)(tag_usage[tag].fetch_add(pending, std::memory_order_relaxed) + pending);
+    }
+
+    void flush_tags(thread_stats_t* block)
+    {
+        for (u32 tag = 0; tag < max_memory_tags; ++tag)
+        {
+            if (block->counters[stat_tag_bytes + tag].load(std::memory_order_relaxed) != block->tag_flushed[tag])
+                flush_tag(block, tag);
+        }
+    }
+
+    bool shared(const thread_stats_t* block) const { return block == &overflow; }
+
+    void snapshot(u64* totals) const
+    {
+        for (u32 s = 0; s < stat_count; ++s)
+            totals[s] = overflow.counters[s].load(std::memory_order_relaxed);
+
+        u32 top = block_top.load(std::memory_order_acquire);
+
+        for (u32 i = 0; i < top; ++i)
+        {
+            for (u32 s = 0; s < stat_count; ++s)
+                totals[s] += blocks[i].counters[s].load(std::memory_order_relaxed);
+        }
+    }
+
+    thread_stats_t overflow;
+
+    // bytes per tag summed over all threads, lagging every thread's own count
+    // by what it has not flushed yet. the overflow block adds to it directly
+    std::atomic<u64> tag_usage[max_memory_tags];
+
+private:
+    thread_stats_t blocks[max_stats_threads];
+    std::atomic<u32> block_top;
+};
+
+inline stats_registry_t stats_registry;
+
+// the block pointer is trivially destructible so it stays readable after the
+// thread's exit destructors ran, stats_thread_exit_t points it at the overflow
+// block at that point and frees that run later still count
+inline thread_local thread_stats_t* local_stats = nullptr;
+
+struct stats_thread_exit_t
+{
+    thread_stats_t* block = nullptr;
+
+    ~stats_thread_exit_t()
+    {
+        if (!block)
+            return;
+
+        local_stats = &stats_registry.overflow;
+        stats_registry.release(block);
+    }
+};
+
+inline thread_local stats_thread_exit_t stats_thread_exit;
+
+NO_INLINE inline thread_stats_t* stats_attach_thread()
+{
+    thread_stats_t* block = stats_registry.acquire();
+
+    stats_thread_exit.block = block;
+    local_stats = block;
+    return block;
+}
+
+FORCE_INLINE thread_stats_t* stats_local_block()
+{
+    thread_stats_t* block = local_stats;
+    return block ? block : stats_attach_thread();
+}
+
+FORCE_INLINE u64 stats_add(thread_stats_t* block, u32 stat, u64 value)
+{
+    std::atomic<u64>& counter = block->counters[stat];
+
+    if (stats_registry.shared(block))
+        return counter.fetch_add(value, std::memory_order_relaxed) + value;
+
+    u64 total = counter.load(std::memory_order_relaxed) + value;
+    counter.store(total, std::memory_order_relaxed);
+    return total;
+}
+
+FORCE_INLINE void stats_add(u32 stat, u64 value)
+{
+    stats_add(stats_local_block(), stat, value);
+}
+
+FORCE_INLINE void stats_sub(u32 stat, u64 value)
+{
+    stats_add(stat, 0 - value);
+}
+
+FORCE_INLINE u32 stats_size_class(size_t size)
+{
+    if (size <= 16)
+        return 0;
+
+    u32 size_class = bit_scan_reverse(size - 1) - 3;
+    return size_class < stats_size_classes ? size_class : stats_size_classes - 1;
+}
+
+FORCE_INLINE void stats_count_alloc(size_t size)
+{
+    stats_add(stat_bytes_allocated, size);
+    stats_add(stat_alloc_ops + stats_size_class(size), 1);
+}
+
+FORCE_INLINE void stats_count_free(size_t size)
+{
+    stats_add(stat_bytes_freed, size);
+    stats_add(stat_free_ops + stats_size_class(size), 1);
+}
+
+// the uncontended path is one try lock, the clock is only read when the lock
+// was already held by another thread
+template <typename lock_t>
+NO_INLINE void stats_lock_contended(lock_t& mutex)
+{
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+    mutex.lock_exclusive();
+
+    stats_add(stat_lock_contentions, 1);
+    stats_add(stat_lock_wait_ns, (u64)duration_cast<nanoseconds>(steady_clock::now() - start).count());
+}
+
+template <typename lock_t>
+FORCE_INLINE void stats_lock(lock_t& mutex)
+{
+    if (!mutex.try_lock_exclusive())
+        stats_lock_contended(mutex);
+}
+
+// the allocator's lock guard, counts contention into the stats above and in
+// PLTF_LOCK_PROFILE builds into the lock profile under the given name too
+template <typename lock_t>
+class stats_lock_guard {
+public:
+#ifdef PLTF_LOCK_PROFILE
+    stats_lock_guard(lock_t& m, pltf_lock_site* site) : mutex(&m)
+    {
+        probe.acquire(site, [this] { return mutex->try_lock_exclusive(); }, [this] { stats_lock_contended(*mutex); });
+    }
+
+    stats_lock_guard(lock_t& m, const char* name) : stats_lock_guard(m, pltf_lock_profiler.site(name)) {}
+
+    void unlock()
+    {
+        probe.release();
+        mutex->unlock_exclusive();
+        mutex = nullptr;
+    }
+#else
+    stats_lock_guard(lock_t& m, const char*) : mutex(&m) { stats_lock(*mutex); }
+    void unlock() { mutex->unlock_exclusive(); mutex = nullptr; }
+#endif
+
+    ~stats_lock_guard() { if (mutex) unlock(); }
+private:
+    lock_t* mutex;
+#ifdef PLTF_LOCK_PROFILE
+    pltf_lock_probe probe;
+#endif
+};
@@ -0,0 +1,154 @@
+#pragma once
+#include "stats.h"
+
+// allocation tags: a small integer category carried in every heap block's
+// header so the bytes a subsystem holds can be told apart from the rest. the
+// tag comes from the allocating thread (set_memory_tag, scoped in
+// vmm_alloc.h) unless one is passed in, realloc keeps the block's tag.
+//
+// the exact per tag counts are per thread stats counters merged on read. for
+// budget checks every thread folds its count into a shared usage counter once
+// it drifts more than tag_flush_slack bytes from what it folded last, so the
+// budgets see usage that can be off by up to that much per thread and the hot
+// path only touches shared memory on a flush
+constexpr u32 default_memory_tag = 0;
+constexpr i64 tag_flush_slack = 64 * 1024;
+
+typedef void (*budget_callback_t)(u32 tag, size_t used, size_t budget, bool hard);
+
+inline thread_local u32 local_memory_tag = default_memory_tag;
+
+FORCE_INLINE u32 current_memory_tag() { return local_memory_tag; }
+
+// returns the tag that was current, tags past max_memory_tags fall back to the
+// default one
+inline u32 set_memory_tag(u32 tag)
+{
+    u32 previous = local_memory_tag;
+    local_memory_tag = tag < max_memory_tags ? tag : default_memory_tag;
+    return previous;
+}
+
+// a soft budget only calls the callback, once every time usage goes over it.
+// an allocation that would take the tag past its hard budget calls the
+// callback and fails. a budget of 0 is no budget. the callback runs on the
+// allocating thread outside of any heap lock, allocations made from inside it
+// are not checked against budgets again
+class memory_budgets_t
+{
+public:
+    void set(u32 tag, size_t soft, size_t hard)
+    {
+        if (tag >= max_memory_tags)
+            return;
+
+        soft_limits[tag].store(soft, std::memory_order_relaxed);
+        hard_limits[tag].store(hard, std::memory_order_relaxed);
+        over_soft[tag].store(false, std::memory_order_relaxed);
+    }
+
+    void set_callback(budget_callback_t fn)
+    {
+        callback.store(fn, std::memory_order_release);
+    }
+
+    FORCE_INLINE bool admit(u32 tag, size_t size)
+    {
+        size_t hard = hard_limits[tag].load(std::memory_order_relaxed);
+        return !hard || admit_hard(tag, size, hard);
+    }
+
+    FORCE_INLINE void count_alloc(size_t size, u32 tag)
+    {
+        stats_count_alloc(size);
+        count(tag, size);
+    }
+
+    FORCE_INLINE void count_free(size_t size, u32 tag)
+    {
+        stats_count_free(size);
+        count(tag, 0 - (u64)size);
+    }
+
+private:
+    std::atomic<size_t> soft_limits[max_memory_tags];
+    std::atomic<size_t> hard_limits[max_memory_tags];
+    std::atomic<bool> over_soft[max_memory_tags];
+    std::atomic<budget_callback_t> callback;
+
+    static inline thread_local bool in_callback = false;
+
+    FORCE_INLINE void count(u32 tag, u64 delta)
+    {
+        thread_stats_t* block = stats_local_block();
+        u64 bytes = stats_add(block, stat_tag_bytes + tag, delta);
+
+        if (stats_registry.shared(block))
+        {
+            u64 used = stats_registry.tag_usage[tag].fetch_add(delta, std::memory_order_relaxed) + delta;
+            check_soft(tag, (i64)used);
+            return;
+        }
+
+        i64 pending = (i64)(bytes - block->tag_flushed[tag]);
+
+        if (pending > tag_flush_slack || pending < -tag_flush_slack)
+            flush(block, tag);
+    }
+
+    NO_INLINE void flush(thread_stats_t* block, u32 tag)
+    {
+        check_soft(tag, stats_registry.flush_tag(block, tag));
+    }
+
+    FORCE_INLINE void check_soft(u32 tag, i64 used)
+    {
+        size_t soft = soft_limits[tag].load(std::memory_order_relaxed);
+        if (!soft)
+            return;
+
+        if (used > (i64)soft)
+        {
+            if (!over_soft[tag].load(std::memory_order_relaxed) && !over_soft[tag].exchange(true, std::memory_order_relaxed))
+                notify(tag, (size_t)used, soft, false);
+        }
+        else if (over_soft[tag].load(std::memory_order_relaxed))
+            over_soft[tag].store(false, std::memory_order_relaxed);
+    }
+
+    // this thread's unflushed bytes are added in, the other threads' can be
+    // missing by up to tag_flush_slack each
+    NO_INLINE bool admit_hard(u32 tag, size_t size, size_t hard)
+    {
+        if (in_callback)
+            return true;
+
+        thread_stats_t* block = stats_local_block();
+        i64 used = (i64)stats_registry.tag_usage[tag].load(std::memory_order_relaxed);
+
+        if (!stats_registry.shared(block))
+            used += (i64)(block->counters[stat_tag_bytes + tag].load(std::memory_order_relaxed) - block->tag_flushed[tag]);
+
+        if (used < 0)
+            used = 0;
+
+        if ((size_t)used + size <= hard)
+            return true;
+
+        notify(tag, (size_t)used + size, hard, true);
+        return false;
+    }
+
+    void notify(u32 tag, size_t used, size_t budget, bool hard)
+    {
+        budget_callback_t fn = callback.load(std::memory_order_acquire);
+        if (!fn || in_callback)
+            return;
+
+        in_callback = true;
+        fn(tag, used, budget, hard);
+        in_callback = false;
+    }
+};
+
+inline memory_budgets_t memory_budgets;
@@ -0,0 +1,188 @@
+#pragma once
+#include "heap.h"
+
+// per-thread front end for a heap_allocator_t. small blocks are handed out
+// from and returned to thread local stacks without touching the heap lock,
+// the stacks are refilled and drained in batches. blocks are counted in the
+// stats when they reach or leave the caller, not when they move between the
+// cache and the heap
+class heap_tcache_t
+{
+public:
+    static constexpr size_t bin_count = heap_allocator_t::small_bin_count;
+    static constexpr size_t refill_count = 16;
+    static constexpr size_t max_bin_bytes = 32 * 1024;
+    static constexpr size_t min_bin_blocks = 4;
+    static constexpr size_t max_bin_blocks = 64;
+
+    // disabled rather than just flushed, frees that still arrive on this thread
+    // from later thread exit destructors go straight to the heap
+    ~heap_tcache_t()
+    {
+        disable();
+    }
+
+    void enable(heap_allocator_t* h)
+    {
+        if (heap != h)
+            flush();
+
+        heap = h;
+    }
+
+    void disable()
+    {
+        flush();
+        heap = nullptr;
+    }
+
+    bool enabled() const { return heap != nullptr; }
+
+    void* allocate(size_t raw_size, u32 tag = current_memory_tag())
+    {
+        size_t size = align_up(raw_size ? raw_size : 1);
+        size_t index = size / heap_allocator_t::block_align_granule - 1;
+        bin_t& bin = bins[index];
+
+        if (!memory_budgets.admit(tag, size))
+            return nullptr;
+
+        if (bin.head)
+            stats_add(stat_tcache_hits, 1);
+        else if (!refill(bin, size))
+            return nullptr;
+
+        cached_block_t* block = bin.head;
+        bin.head = block->next;
+        --bin.count;
+
+        heap_allocator_t::set_tag(block, tag);
+        memory_budgets.count_alloc(heap_allocator_t::usable_size(block), tag);
+        return block;
+    }
+
+    // returns false when the block is not cacheable and has to go to the heap
+    bool free(void* ptr)
+    {
+        size_t size = heap_allocator_t::usable_size(ptr);
+
+        if (size > heap_allocator_t::small_size_limit)
+            return false;
+
+        memory_budgets.count_free(size, heap_allocator_t::tag_of(ptr));
+
+        size_t index = size / heap_allocator_t::block_align_granule - 1;
+        bin_t& bin = bins[index];
+
+        auto* block = static_cast<cached_block_t*>(ptr);
+        block->next = bin.head;
+        bin.head = block;
+
+        if (++bin.count > bin_capacity(size))
+            drain(bin, bin.count / 2);
+
+        return true;
+    }
+
+    // the caller knows the size it asked for, the block is binned by it without
+    // reading the header. the block may be bigger than the bin it lands in,
+    // which only wastes the difference until it goes back to the heap. the
+    // stats still take the block's real size so they balance with allocate
+    bool free_sized(void* ptr, size_t raw_size)
+    {
+        size_t size = align_up(raw_size ? raw_size : 1);
+
+        if (size > heap_allocator_t::small_size_limit)
+            return false;
+
+        bin_t& bin = bins[size / heap_allocator_t::block_align_granule - 1];
+        memory_budgets.count_free(heap_allocator_t::usable_size(ptr), heap_allocator_t::tag_of(ptr));
+
+        auto* block = static_cast<cached_block_t*>(ptr);
+        block->next = bin.head;
+        bin.head = block;
+
+        if (++bin.count > bin_capacity(size))
+            drain(bin, bin.count / 2);
+
+        return true;
+    }
+
+    void flush()
+    {
+        if (!heap)
+            return;
+
+        for (size_t i = 0; i < bin_count; ++i)
+            drain(bins[i], bins[i].count);
+    }
+
+private:
+    struct cached_block_t {
+        cached_block_t* next;
+    };
+
+    struct bin_t {
+        cached_block_t* head = nullptr;
+        size_t count = 0;
+    };
+
+    heap_allocator_t* heap = nullptr;
+    bin_t bins[bin_count];
+
+    static size_t align_up(size_t v)
+    {
+        return (v + heap_allocator_t::block_align_granule - 1) & ~(heap_allocator_t::block_align_granule - 1);
+    }
+
+    static size_t bin_capacity(size_t size)
+    {
+        size_t blocks = max_bin_bytes / size;
+
+        if (blocks < min_bin_blocks)
+            return min_bin_blocks;
+
+        return blocks > max_bin_blocks ? max_bin_blocks : blocks;
+    }
+
+    bool refill(bin_t& bin, size_t size)
+    {
+        void* batch[refill_count];
+        size_t got = heap->allocate_blocks(size, refill_count, batch);
+
+        for (size_t i = 0; i < got; ++i)
+        {
+            auto* block = static_cast<cached_block_t*>(batch[i]);
+            block->next = bin.head;
+            bin.head = block;
+        }
+
+        bin.count += got;
+        return got != 0;
+    }
+
+    void drain(bin_t& bin, size_t count)
+    {
+        void* batch[max_bin_blocks];
+
+        while (count)
+        {
+            size_t n = 0;
+
+            for (; n < max_bin_blocks && n < count && bin.head; ++n)
+            {
+                batch[n] = bin.head;
+                bin.head = bin.head->next;
+            }
+
+            if (!n)
+                break;
+
+            heap->free_blocks(batch, n);
+            bin.count -= n;
+            count -= n;
+        }
+    }
+};
+
+inline thread_local heap_tcache_t heap_tcache;
@@ -1,15 +1,43 @@
 #pragma once
 #include <datatypes.h>
+#include <bitops.h>
 #include <mtx.h>
+#include <thread.h>
 #include <io.h>
 #include <mem.h>
+#include <chrono>
+#include "stats.h"
 
 constexpr int _page_size = 0x1000;
 
-struct page_info_t
+// node describing one free run, free runs are the only thing that needs more
+// than a length so they live in their own array instead of in every page slot
+struct free_run_t
 {
-    void* base_address = nullptr;
-    ul64 size_in_pages = 0;
+    u32 start = 0;
+    u32 size_in_pages = 0;
+    u32 next_free = 0;
+    u32 prev_free = 0;
+};
+
+// freed run that is still committed, binned like a free run and also kept on
+// an age list ordered by the time it was freed
+struct retained_run_t
+{
+    u32 start = 0;
+    u32 size_in_pages = 0;
+    u32 next_free = 0;
+    u32 prev_free = 0;
+    u32 retired_at = 0;
+    u32 next_retired = 0;
+    u32 prev_retired = 0;
+};
+
+// a retained run past its decay time, decommitted outside the pool lock
+struct expired_run_t
+{
+    ul64 start;
+    ul64 pages;
 };
 
 class virtual_memory_pool
@@ -30,57 +58,121 @@ public:
     }
 
 public:
+    // runs up to exact_bin_pages get a bin per page count, longer runs share
+    // 1 << log_bin_bits bins per power of two
+    static constexpr ul64 exact_bin_pages = 64;
+    static constexpr ul64 log_bin_bits = 2;
+    static constexpr ul64 bin_count = exact_bin_pages + (32 << log_bin_bits);
+    static constexpr ul64 bin_words = (bin_count + 63) / 64;
+
+    // metadata is committed in steps of this many bytes as the pool grows
+    static constexpr ul64 metadata_commit_granule = 64 * 1024;
+
+    // freed runs stay committed for this long before they are decommitted,
+    // up to retain_limit bytes at a time
+    static constexpr u32 default_decay_ms = 10000;
+    static constexpr ul64 default_retain_limit = 256ull * 1024 * 1024;
+    static constexpr ul64 max_retained_runs = 64 * 1024;
+
+    // set in run_slots on the boundary pages of a retained run, next to the
+    // index of its retained_run_t
+    static constexpr u32 retained_slot_bit = 0x80000000u;
+
+    // set in run_slots on the boundary pages of the uncommitted headroom that
+    // follows a run from allocate_reserved, next to the headroom length
+    static constexpr u32 headroom_slot_bit = 0x40000000u;
+
+    // set in run_slots on the first page of a run from allocate_reserved
+    static constexpr u32 reserved_slot_bit = 0x20000000u;
+
+    // realloc moves runs at least this big by remapping their pages instead of copying
+    static constexpr ul64 remap_threshold = 1024 * 1024;
+
+    // expired retained runs a single free decommits, the rest wait for the
+    // next one. runs over the retain limit are always all taken out, in
+    // rounds of this many
+    static constexpr u32 max_expired_per_free = 8;
 
     void destroy()
     {
 		if (pool)
 		{
-			virtual_free_release(pool);
+			virtual_free_release(pool, total_reserved_size);
+
+			stats_add(stat_pages_decommitted, committed_pages);
+			stats_sub(stat_node_pages + stats_node(), committed_pages);
+			stats_sub(stat_retained_pages, retained_pages);
+			stats_sub(stat_metadata_bytes, slots_committed + 2 * bits_committed + runs_committed + retained_committed);
+
 			pool = nullptr;
-			pages = nullptr;
+			numa_node = any_numa_node;
+			run_slots = nullptr;
+			used_bits = nullptr;
+			head_bits = nullptr;
+			runs = nullptr;
+			retained = nullptr;
 			page_count = 0;
+			top_page = 0;
 			metadata_page_count = 0;
 			metadata_size = 0;
 			total_reserved_size = 0;
+			committed_pages = 0;
+			slots_committed = 0;
+			bits_committed = 0;
+			runs_committed = 0;
+			retained_committed = 0;
+			run_top = 0;
+			retained_top = 0;
+			free_retained_nodes = 0;
+			free_run_nodes = 0;
+			oldest_retired = 0;
+			newest_retired = 0;
+			retained_pages = 0;
+
+			for (ul64 i = 0; i < bin_count; ++i)
+				free_bins[i] = retained_bins[i] = 0;
+
+			for (ul64 i = 0; i < bin_words; ++i)
+				bin_bitmap[i] = retained_bitmap[i] = 0;
 		}
     }
 
+    // only the address space is set up here, metadata pages are committed as
+    // top_page (the high water mark of handed out pages) moves up
     bool initialize()
     {
         if (pool)
             return true;
 
-        MEMORYSTATUSEX memStatus = { sizeof(memStatus) };
-        GlobalMemoryStatusEx(&memStatus);
+        ul64 granularity = virtual_alloc_granularity();
+        ul64 aligned_size = (physical_memory_size() + granularity - 1) & ~(granularity - 1);
 
-        SYSTEM_INFO sysInfo;
-        GetSystemInfo(&sysInfo);
-
-        ul64 granularity = sysInfo.dwAllocationGranularity;
-        ul64 aligned_size = (memStatus.ullTotalPhys + granularity - 1) & ~(granularity - 1);
-
-        total_reserved_size = aligned_size;
         pool = virtual_alloc_reserve(nullptr, aligned_size);
 
         if (!pool)
             return false;
 
+        total_reserved_size = aligned_size;
+
         page_count = total_reserved_size / _page_size;
 
-        metadata_size = page_count * sizeof(page_info_t);
-        metadata_page_count = (metadata_size + _page_size - 1) / _page_size;
+        slots_size = page_align(page_count * sizeof(u32));
+        bits_size = page_align((page_count + 63) / 64 * sizeof(u64));
+        runs_size = page_align((page_count / 2 + 2) * sizeof(free_run_t));
+        retained_size = page_align((max_retained_runs + 1) * sizeof(retained_run_t));
 
-        pages = reinterpret_cast<page_info_t*>(pool);
-        void* committed = virtual_alloc_commit(pages, metadata_page_count * _page_size);
+        metadata_size = slots_size + 2 * bits_size + runs_size + retained_size;
+        metadata_page_count = metadata_size / _page_size;
 
-        if (!committed)
-        {
-            virtual_free_release(pool);
-            pool = nullptr;
-            return false;
-        }
+        run_slots = reinterpret_cast<u32*>(pool);
+        used_bits = reinterpret_cast<u64*>((char*)run_slots + slots_size);
+        head_bits = reinterpret_cast<u64*>((char*)used_bits + bits_size);
+        runs = reinterpret_cast<free_run_t*>((char*)head_bits + bits_size);
+        retained = reinterpret_cast<retained_run_t*>((char*)runs + runs_size);
 
-        ZeroMemory(pages, metadata_page_count * _page_size);
+        top_page = metadata_page_count;
+        run_top = 1;
+        retained_top = 1;
 
         return true;
     }
@@ -96,229 +188,977 @@ public:
             return nullptr;
         }
 
-        mgr_lock.lock_exclusive();
+        stats_lock_guard lock(mgr_lock, PLTF_LOCK_SITE("mgr_lock"));
 
-        ul64 offset = static_cast<char*>(ptr) - static_cast<char*>(pool);
-        ul64 page_index = offset / _page_size;
-
-        if (page_index < metadata_page_count || page_index >= page_count) {
-            mgr_lock.unlock_exclusive();
-            return nullptr;
-        }
-
-        ul64 old_page_count = pages[page_index].size_in_pages;
+        ul64 page_index = run_index(ptr);
 
-        if (old_page_count == 0) {
-            mgr_lock.unlock_exclusive();
+        if (page_index == 0) {
+            lock.unlock();
             return nullptr;
         }
 
+        ul64 old_page_count = used_run_pages(page_index);
+        bool reserved = test_reserved(page_index);
         ul64 new_page_count = (new_size + _page_size - 1) / _page_size;
 
         if (new_page_count < old_page_count)
         {
+            lock.unlock();
             ul64 shrink_size = new_page_count * _page_size;
             bool ok = shrink(ptr, shrink_size);
-            mgr_lock.unlock_exclusive();
             return ok ? ptr : nullptr;
         }
 
         if (new_page_count == old_page_count)
         {
-            mgr_lock.unlock_exclusive();
+            lock.unlock();
             return ptr;
         }
 
-        bool can_extend = true;
-        for (ul64 i = 0; i < (new_page_count - old_page_count); ++i)
+        ul64 extra_pages = new_page_count - old_page_count;
+        ul64 next_index = page_index + old_page_count;
+        bool at_top = next_index == top_page;
+        bool into_headroom = false;
+        ul64 next_pages = 0;
+
+        if (at_top)
+            next_pages = page_count - top_page;
+        else if (is_free_slot(next_index))
+            next_pages = runs[run_slots[next_index]].size_in_pages;
+        else if (is_headroom_slot(next_index))
         {
-            if (pages[page_index + old_page_count + i].base_address != nullptr)
-            {
-                can_extend = false;
-                break;
-            }
+            next_pages = run_slots[next_index] & ~headroom_slot_bit;
+            into_headroom = true;
         }
 
-        if (can_extend)
+        if (next_pages >= extra_pages)
         {
-            void* extend_start = static_cast<char*>(pool) + (page_index + old_page_count) * _page_size;
-            ul64 extra_size = (new_page_count - old_page_count) * _page_size;
+            void* extend_start = static_cast<char*>(pool) + next_index * _page_size;
+
+            if (at_top && !grow_top(next_index + extra_pages)) {
+                lock.unlock();
+                return nullptr;
+            }
 
-            void* committed = virtual_alloc_commit(extend_start, extra_size);
+            void* committed = virtual_alloc_commit(extend_start, extra_pages * _page_size, numa_node);
 
             if (!committed) {
-                mgr_lock.unlock_exclusive();
+                if (at_top)
+                    top_page = next_index;
+
+                lock.unlock();
                 return nullptr;
             }
 
+            if (!at_top && !into_headroom)
+            {
+                u32 node = run_slots[next_index];
+                unlink_free_run(node);
+                release_run_node(node);
+            }
+
+            mark_used_run(page_index, new_page_count, reserved);
 
-            for (ul64 i = 0; i < (new_page_count - old_page_count); ++i)
-                pages[page_index + old_page_count + i].base_address = ptr;
+            if (!at_top && next_pages > extra_pages)
+            {
+                if (into_headroom)
+                    mark_headroom_run(page_index + new_page_count, next_pages - extra_pages);
+                else
+                    insert_free_run(page_index + new_page_count, next_pages - extra_pages);
+            }
 
-            pages[page_index].size_in_pages = new_page_count;
+            add_committed(extra_pages);
 
-            mgr_lock.unlock_exclusive();
+            lock.unlock();
             return ptr;
         }
 
-        mgr_lock.unlock_exclusive();
-
-        void* new_ptr = allocate(new_size);
+        void* new_ptr = allocate_run(new_size, new_size, 1, false);
 
         if (!new_ptr) {
+            lock.unlock();
             return nullptr;
         }
 
         ul64 old_size = old_page_count * _page_size;
+
+        // big runs get their pages moved instead of copied, the old range is
+        // left empty and goes straight back to the free runs. an old range that
+        // couldn't be mapped again is a hole in the reservation, its pages are
+        // given up for good rather than handed out over someone else's mapping
+        bool old_lost = false;
+
+        if (old_size >= remap_threshold && virtual_remap(ptr, old_size, new_ptr, old_lost))
+        {
+            clear_bit(head_bits, page_index);
+            release_headroom(page_index + old_page_count);
+
+            if (!old_lost)
+            {
+                // the old range was mapped again from scratch and lost its node
+                if (numa_node != any_numa_node)
+                    virtual_alloc_bind_node(ptr, old_size, numa_node);
+
+                insert_free_run(page_index, old_page_count);
+            }
+
+            sub_committed(old_page_count);
+
+            lock.unlock();
+            return new_ptr;
+        }
+
+        lock.unlock();
+
         memcpy(new_ptr, ptr, old_size);
         free(ptr);
 
         return new_ptr;
     }
 
+    // reserves max_size bytes of address space but only commits size, realloc
+    // grows into the rest in place so long lived buffers never move
+    void* allocate_reserved(ul64 size, ul64 max_size)
+    {
+        stats_lock_guard lock(mgr_lock, PLTF_LOCK_SITE("mgr_lock"));
+        return allocate_run(max_size > size ? max_size : size, size, 1, false);
+    }
+
     void* allocate(ul64 size)
     {
-        pltf_lock_guard lock(mgr_lock);
+        stats_lock_guard lock(mgr_lock, PLTF_LOCK_SITE("mgr_lock"));
+        return allocate_run(size, size, 1, false);
+    }
+
+    // run starting on a huge_page_size boundary, committed with the transparent
+    // huge page hint so long lived arenas don't pay a tlb miss per 4k page
+    void* allocate_huge(ul64 size)
+    {
+        stats_lock_guard lock(mgr_lock, PLTF_LOCK_SITE("mgr_lock"));
+
+        ul64 huge_pages = huge_page_size / _page_size;
+        ul64 aligned_size = (size + huge_page_size - 1) & ~(ul64)(huge_page_size - 1);
+
+        return allocate_run(aligned_size, aligned_size, huge_pages, true);
+    }
+
+    bool shrink(void* ptr, ul64 new_size)
+    {
+        expired_run_t expired[max_expired_per_free];
+        stats_lock_guard lock(mgr_lock, PLTF_LOCK_SITE("mgr_lock"));
+
+        if (!ptr || new_size == 0)
+            return false;
+
+        ul64 page_index = run_index(ptr);
+
+        if (page_index == 0)
+            return false;
+
+        ul64 current_pages = used_run_pages(page_index);
+        bool reserved = test_reserved(page_index);
+        ul64 new_pages = (new_size + _page_size - 1) / _page_size;
+
+        if (new_pages >= current_pages)
+            return true;
+
+        ul64 pages_to_free = current_pages - new_pages;
+        ul64 tail_index = page_index + new_pages;
+        void* decommit_base = static_cast<char*>(ptr) + new_pages * _page_size;
+
+        mark_used_run(page_index, new_pages, reserved);
+
+        // pages given back by a run from allocate_reserved go back to its headroom
+        if (reserved)
+        {
+            ul64 headroom_index = tail_index + pages_to_free;
+            ul64 headroom_pages = 0;
+
+            if (headroom_index < top_page && is_headroom_slot(headroom_index))
+                headroom_pages = run_slots[headroom_index] & ~headroom_slot_bit;
+
+            decomit(decommit_base, pages_to_free * _page_size);
+            mark_headroom_run(tail_index, pages_to_free + headroom_pages);
+
+            sub_committed(pages_to_free);
+        }
+        else
+            retire_run(tail_index, pages_to_free);
+
+        u32 expired_count = take_expired(now_ms(), false, expired, max_expired_per_free);
+        lock.unlock();
+
+        if (expired_count)
+            release_expired(expired, expired_count, false);
+
+        return true;
+    }
+
+    // the clock is read before the lock, expired runs are taken out under it
+    // and decommitted after it is released
+    void free(void* address)
+    {
+        if (!address)
+            return;
 
-        if (!pool || size == 0)
+        u32 now = now_ms();
+        expired_run_t expired[max_expired_per_free];
+        u32 expired_count;
+
+        {
+            stats_lock_guard lock(mgr_lock, PLTF_LOCK_SITE("mgr_lock"));
+
+            if (!pool)
+                return;
+
+            ul64 page_index = run_index(address);
+
+            if (page_index == 0)
+                return;
+
+            ul64 count = used_run_pages(page_index);
+
+            clear_bit(head_bits, page_index);
+            release_headroom(page_index + count);
+            retire_run(page_index, count, now);
+
+            expired_count = take_expired(now, false, expired, max_expired_per_free);
+        }
+
+        if (expired_count)
+            release_expired(expired, expired_count, false);
+    }
+
+    // decommits retained runs, all of them or only the ones past the decay time.
+    // there is no purge thread, expired runs are dropped on the next free and
+    // callers that want the memory back sooner call this from a job
+    void purge(bool all)
+    {
+        stats_lock_guard lock(mgr_lock, PLTF_LOCK_SITE("mgr_lock"));
+        purge_retained(all);
+    }
+
+    // decay_ms of 0 turns the retained cache off and decommits on free again
+    void set_decay(u32 new_decay_ms, ul64 new_retain_limit)
+    {
+        u32 now = now_ms();
+        expired_run_t expired[max_expired_per_free];
+        u32 expired_count;
+        bool all = new_decay_ms == 0;
+
+        {
+            stats_lock_guard lock(mgr_lock, PLTF_LOCK_SITE("mgr_lock"));
+
+            decay_ms = new_decay_ms;
+            retain_limit = new_retain_limit;
+
+            expired_count = take_expired(now, all, expired, max_expired_per_free);
+        }
+
+        if (expired_count)
+            release_expired(expired, expired_count, all);
+    }
+
+    // pages committed from now on prefer node, the ones already committed
+    // stay where they are but are counted under node from here on
+    void bind_node(u32 node)
+    {
+        stats_lock_guard lock(mgr_lock, PLTF_LOCK_SITE("mgr_lock"));
+
+        if (!pool || node >= max_numa_nodes)
+            return;
+
+        stats_sub(stat_node_pages + stats_node(), committed_pages);
+        stats_add(stat_node_pages + node, committed_pages);
+
+        numa_node = node;
+        virtual_alloc_bind_node(pool, total_reserved_size, node);
+    }
+
+    bool contains(const void* ptr) const
+    {
+        return ptr >= pool && ptr < (const char*)pool + total_reserved_size;
+    }
+
+    ul64 reserved_bytes() const { return total_reserved_size; }
+    ul64 committed_peak_bytes() const { return committed_peak.load(std::memory_order_relaxed) * _page_size; }
+
+private:
+    void* pool = nullptr;
+    pltf_spin_mutex mgr_lock;
+    ul64 page_count = 0;
+    ul64 top_page = 0;
+    ul64 metadata_page_count = 0;
+    ul64 metadata_size = 0;
+    ul64 total_reserved_size = 0;
+    ul64 committed_pages = 0;
+    std::atomic<ul64> committed_peak = 0;
+    u32 numa_node = any_numa_node;
+
+    // per page metadata: run_slots holds a run's length on its first and last
+    // page for used runs, the free_run_t index for free runs and the tagged
+    // retained_run_t index for retained runs. used_bits tells used runs apart
+    // on those boundary pages, head_bits marks the first page of every used
+    // run so stray pointers are rejected
+    u32* run_slots = nullptr;
+    u64* used_bits = nullptr;
+    u64* head_bits = nullptr;
+    free_run_t* runs = nullptr;
+    retained_run_t* retained = nullptr;
+
+    ul64 slots_size = 0;
+    ul64 bits_size = 0;
+    ul64 runs_size = 0;
+    ul64 retained_size = 0;
+    ul64 slots_committed = 0;
+    ul64 bits_committed = 0;
+    ul64 runs_committed = 0;
+    ul64 retained_committed = 0;
+
+    u32 run_top = 0;
+    u32 free_run_nodes = 0;
+    u32 free_bins[bin_count] = {};
+    u64 bin_bitmap[bin_words] = {};
+
+    // freed runs that are still committed. their boundary slots carry
+    // retained_slot_bit so free neighbours don't merge into them
+    u32 retained_top = 0;
+    u32 free_retained_nodes = 0;
+    u32 retained_bins[bin_count] = {};
+    u64 retained_bitmap[bin_words] = {};
+    u32 oldest_retired = 0;
+    u32 newest_retired = 0;
+    ul64 retained_pages = 0;
+    u32 decay_ms = default_decay_ms;
+    ul64 retain_limit = default_retain_limit;
+
+    static ul64 page_align(ul64 v)
+    {
+        return (v + _page_size - 1) & ~(ul64)(_page_size - 1);
+    }
+
+    // committed_pages is only touched under mgr_lock, the peak is atomic so
+    // stats readers don't have to take it
+    void add_committed(ul64 pages)
+    {
+        committed_pages += pages;
+        stats_add(stat_pages_committed, pages);
+        stats_add(stat_node_pages + stats_node(), pages);
+
+        if (committed_pages > committed_peak.load(std::memory_order_relaxed))
+            committed_peak.store(committed_pages, std::memory_order_relaxed);
+    }
+
+    void sub_committed(ul64 pages)
+    {
+        committed_pages -= pages;
+        stats_add(stat_pages_decommitted, pages);
+        stats_sub(stat_node_pages + stats_node(), pages);
+    }
+
+    // a pool that isn't bound to a node counts as node 0
+    u32 stats_node() const
+    {
+        return numa_node == any_numa_node ? 0 : numa_node;
+    }
+
+    static bool test_bit(const u64* bits, ul64 index) { return bits[index / 64] & (1ull << (index % 64)); }
+    static void set_bit(u64* bits, ul64 index) { bits[index / 64] |= 1ull << (index % 64); }
+    static void clear_bit(u64* bits, ul64 index) { bits[index / 64] &= ~(1ull << (index % 64)); }
+
+    static ul64 bin_index(ul64 run_pages)
+    {
+        if (run_pages <= exact_bin_pages)
+            return run_pages - 1;
+
+        u32 msb = bit_scan_reverse(run_pages);
+        ul64 sub = (run_pages >> (msb - log_bin_bits)) & ((1ull << log_bin_bits) - 1);
+        ul64 index = exact_bin_pages + ((msb - bit_scan_reverse(exact_bin_pages)) << log_bin_bits) + sub;
+
+        return index < bin_count ? index : bin_count - 1;
+    }
+
+    bool commit_metadata(void* base, ul64 needed, ul64 reserved, ul64& committed)
+    {
+        if (needed <= committed)
+            return true;
+
+        ul64 target = (needed + metadata_commit_granule - 1) & ~(metadata_commit_granule - 1);
+        if (target > reserved)
+            target = reserved;
+
+        if (!virtual_alloc_commit((char*)base + committed, target - committed, numa_node))
+            return false;
+
+        stats_add(stat_metadata_bytes, target - committed);
+        committed = target;
+        return true;
+    }
+
+    bool grow_top(ul64 new_top)
+    {
+        if (!commit_metadata(run_slots, new_top * sizeof(u32), slots_size, slots_committed))
+            return false;
+
+        // both bitmaps are the same size and grow in lockstep
+        ul64 bits_needed = (new_top + 63) / 64 * sizeof(u64);
+        ul64 head_committed = bits_committed;
+
+        if (!commit_metadata(head_bits, bits_needed, bits_size, head_committed))
+            return false;
+
+        if (!commit_metadata(used_bits, bits_needed, bits_size, bits_committed))
+            return false;
+
+        top_page = new_top;
+        return true;
+    }
+
+    // carves a run of size bytes whose first page is a multiple of align_pages
+    // pages from the start of the address space. runs are searched with
+    // align_pages - 1 pages of slack, the gaps in front of and behind the
+    // aligned run go back to the free bins. only the first commit_size bytes
+    // are committed, the rest of the run is kept as headroom
+    void* allocate_run(ul64 size, ul64 commit_size, ul64 align_pages, bool huge)
+    {
+        if (!pool || size == 0 || commit_size == 0)
             return nullptr;
 
-        ul64 aligned_size = (size + _page_size - 1) & ~(_page_size - 1);
+        ul64 aligned_size = (size + _page_size - 1) & ~(ul64)(_page_size - 1);
         ul64 required_pages = aligned_size / _page_size;
+        ul64 commit_pages = (commit_size + _page_size - 1) / _page_size;
+        ul64 slack = align_pages - 1;
 
-        if (required_pages + metadata_page_count > page_count)
+        if (required_pages + slack + metadata_page_count > page_count)
             return nullptr;
 
-        for (ul64 i = metadata_page_count; i <= page_count - required_pages; ++i)
+        if (align_pages == 1 && !huge && commit_pages == required_pages)
         {
-            bool all_free = true;
-            for (ul64 j = 0; j < required_pages; ++j)
-            {
-                if (pages[i + j].base_address != nullptr)
-                {
-                    all_free = false;
-                    i += j;
-                    break;
-                }
-            }
+            if (void* recycled = take_retained(required_pages))
+                return recycled;
+        }
 
-            if (all_free)
-            {
-                void* base = static_cast<char*>(pool) + i * _page_size;
-                void* committed = virtual_alloc_commit(base, aligned_size);
+        u32 node = find_free_run(required_pages + slack);
+        ul64 start = node ? runs[node].start : top_page;
 
-                if (!committed)
-                {
-                    return nullptr;
-                }
+        ul64 pool_page = reinterpret_cast<ul64>(pool) / _page_size;
+        ul64 i = (pool_page + start + slack) / align_pages * align_pages - pool_page;
 
-                for (ul64 j = 0; j < required_pages; ++j)
-                    pages[i + j].base_address = base;
+        if (!node && (i + required_pages > page_count || !grow_top(i + required_pages)))
+            return nullptr;
 
-                pages[i].size_in_pages = required_pages;
+        void* base = static_cast<char*>(pool) + i * _page_size;
+        ul64 commit_bytes = commit_pages * _page_size;
+        void* committed = huge ? virtual_alloc_commit_huge(base, commit_bytes, numa_node) : virtual_alloc_commit(base, commit_bytes, numa_node);
 
-                return base;
-            }
+        if (!committed)
+        {
+            if (!node)
+                top_page = start;
+
+            return nullptr;
         }
 
-        return nullptr;
+        mark_used_run(i, commit_pages, required_pages > commit_pages);
+        set_bit(head_bits, i);
+
+        if (required_pages > commit_pages)
+            mark_headroom_run(i + commit_pages, required_pages - commit_pages);
+
+        if (node)
+        {
+            ul64 run_end = start + runs[node].size_in_pages;
+            unlink_free_run(node);
+            release_run_node(node);
+
+            if (run_end > i + required_pages)
+                insert_free_run(i + required_pages, run_end - i - required_pages);
+        }
+
+        if (i > start)
+            insert_free_run(start, i - start);
+
+        add_committed(commit_pages);
+
+        return base;
     }
 
-    bool shrink(void* ptr, ul64 new_size)
+    u32 acquire_run_node()
     {
-        pltf_lock_guard lock(mgr_lock);
+        if (free_run_nodes)
+        {
+            u32 node = free_run_nodes;
+            free_run_nodes = runs[node].next_free;
+            return node;
+        }
 
-        if (!ptr || new_size == 0)
-            return false;
+        if (!commit_metadata(runs, (run_top + 1) * sizeof(free_run_t), runs_size, runs_committed))
+            return 0;
+
+        return run_top++;
+    }
+
+    void release_run_node(u32 node)
+    {
+        runs[node].next_free = free_run_nodes;
+        free_run_nodes = node;
+    }
+
+    // page index of the used run starting at ptr, 0 when ptr is not the start of one
+    ul64 run_index(void* ptr) const
+    {
+        if (ptr < pool)
+            return 0;
 
         ul64 offset = static_cast<char*>(ptr) - static_cast<char*>(pool);
         ul64 page_index = offset / _page_size;
 
-        if (page_index < metadata_page_count || page_index >= page_count)
-            return false;
+        if (offset % _page_size || page_index < metadata_page_count || page_index >= top_page)
+            return 0;
 
-        ul64 current_pages = pages[page_index].size_in_pages;
+        if (!test_bit(head_bits, page_index))
+            return 0;
 
-        if (current_pages == 0)
-            return false;
+        return page_index;
+    }
 
-        ul64 new_pages = (new_size + _page_size - 1) / _page_size;
+    // reserved runs own the headroom behind them, the flag only lives on the
+    // first slot since nothing reads a used run's length from its last page
+    void mark_used_run(ul64 start, ul64 run_pages, bool reserved = false)
+    {
+        ul64 last = start + run_pages - 1;
 
-        if (new_pages >= current_pages)
-            return true;
+        run_slots[last] = (u32)run_pages;
+        run_slots[start] = (u32)run_pages | (reserved ? reserved_slot_bit : 0);
+        set_bit(used_bits, start);
+        set_bit(used_bits, last);
+    }
 
-        ul64 pages_to_free = current_pages - new_pages;
-        void* decommit_base = static_cast<char*>(ptr) + new_pages * _page_size;
+    ul64 used_run_pages(ul64 start) const { return run_slots[start] & ~reserved_slot_bit; }
+    bool test_reserved(ul64 start) const { return run_slots[start] & reserved_slot_bit; }
 
-        if (!decomit(decommit_base, pages_to_free * _page_size))
-            return false;
+    void mark_free_run(ul64 start, ul64 run_pages, u32 node)
+    {
+        ul64 last = start + run_pages - 1;
+
+        run_slots[start] = run_slots[last] = node;
+        clear_bit(used_bits, start);
+        clear_bit(used_bits, last);
+    }
 
-        for (ul64 i = new_pages; i < current_pages; ++i)
-            pages[page_index + i].base_address = nullptr;
+    // free and retained runs are binned the same way, each set has its own nodes and bins
+    template <typename node_t>
+    static void link_run(node_t* nodes, u32* bins, u64* bitmap, u32 node)
+    {
+        ul64 bin = bin_index(nodes[node].size_in_pages);
+        node_t& info = nodes[node];
 
-        pages[page_index].size_in_pages = new_pages;
+        info.prev_free = 0;
+        info.next_free = bins[bin];
 
-        return true;
+        if (bins[bin])
+            nodes[bins[bin]].prev_free = node;
+
+        bins[bin] = node;
+        bitmap[bin / 64] |= 1ull << (bin % 64);
     }
 
-    void free(void* address)
+    template <typename node_t>
+    static void unlink_run(node_t* nodes, u32* bins, u64* bitmap, u32 node)
+    {
+        ul64 bin = bin_index(nodes[node].size_in_pages);
+        node_t& info = nodes[node];
+
+        if (info.prev_free)
+            nodes[info.prev_free].next_free = info.next_free;
+        else
+            bins[bin] = info.next_free;
+
+        if (info.next_free)
+            nodes[info.next_free].prev_free = info.prev_free;
+
+        if (!bins[bin])
+            bitmap[bin / 64] &= ~(1ull << (bin % 64));
+    }
+
+    void link_free_run(u32 node) { link_run(runs, free_bins, bin_bitmap, node); }
+    void unlink_free_run(u32 node) { unlink_run(runs, free_bins, bin_bitmap, node); }
+
+    // merges [start, start + run_pages) with free neighbours and bins the
+    // result, a run that ends up touching top_page is handed back to the
+    // untouched space above the high water mark instead
+    void insert_free_run(ul64 start, ul64 run_pages)
     {
-        pltf_lock_guard lock(mgr_lock);
+        u32 node = 0;
 
-        if (!address || !pool)
+        if (start > metadata_page_count && is_free_slot(start - 1))
+        {
+            node = run_slots[start - 1];
+            unlink_free_run(node);
+
+            start = runs[node].start;
+            run_pages += runs[node].size_in_pages;
+        }
+
+        ul64 next_index = start + run_pages;
+
+        if (next_index < top_page && is_free_slot(next_index))
+        {
+            u32 next_node = run_slots[next_index];
+            unlink_free_run(next_node);
+
+            run_pages += runs[next_node].size_in_pages;
+            release_run_node(next_node);
+        }
+
+        if (start + run_pages == top_page)
+        {
+            if (node)
+                release_run_node(node);
+
+            top_page = start;
+            return;
+        }
+
+        if (!node && !(node = acquire_run_node()))
             return;
 
-        ul64 offset = static_cast<char*>(address) - static_cast<char*>(pool);
-        ul64 page_index = offset / _page_size;
+        runs[node].start = (u32)start;
+        runs[node].size_in_pages = (u32)run_pages;
+
+        mark_free_run(start, run_pages, node);
+        link_free_run(node);
+    }
+
+    // the head of the request's own bin may be too short for log spaced bins,
+    // every run in a higher bin is guaranteed to fit. returns 0 when nothing fits
+    template <typename node_t>
+    static u32 find_run(const node_t* nodes, const u32* bins, const u64* bitmap, ul64 run_pages)
+    {
+        ul64 bin = bin_index(run_pages);
+        u32 node = bins[bin];
+
+        if (node && nodes[node].size_in_pages >= run_pages)
+            return node;
+
+        for (ul64 word = (bin + 1) / 64; word < bin_words; ++word)
+        {
+            u64 mask = bitmap[word];
+
+            if (word == (bin + 1) / 64)
+                mask &= ~0ull << ((bin + 1) % 64);
+
+            if (mask)
+                return bins[word * 64 + bit_scan_forward(mask)];
+        }
+
+        return 0;
+    }
+
+    u32 find_free_run(ul64 run_pages) const { return find_run(runs, free_bins, bin_bitmap, run_pages); }
+
+    static u32 now_ms()
+    {
+        using namespace std::chrono;
+        return (u32)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    // decommits a used run that has already lost its head bit and bins it as free
+    void release_run(ul64 start, ul64 run_pages)
+    {
+        decomit(static_cast<char*>(pool) + start * _page_size, run_pages * _page_size);
+        insert_free_run(start, run_pages);
+
+        sub_committed(run_pages);
+    }
+
+    u32 acquire_retained_node()
+    {
+        if (free_retained_nodes)
+        {
+            u32 node = free_retained_nodes;
+            free_retained_nodes = retained[node].next_free;
+            return node;
+        }
+
+        if (retained_top > max_retained_runs)
+            return 0;
+
+        if (!commit_metadata(retained, (retained_top + 1) * sizeof(retained_run_t), retained_size, retained_committed))
+            return 0;
+
+        return retained_top++;
+    }
+
+    void release_retained_node(u32 node)
+    {
+        retained[node].next_free = free_retained_nodes;
+        free_retained_nodes = node;
+    }
+
+    bool is_free_slot(ul64 index) const
+    {
+        return !test_bit(used_bits, index) && !(run_slots[index] & retained_slot_bit);
+    }
+
+    bool is_retained_slot(ul64 index) const
+    {
+        return !test_bit(used_bits, index) && (run_slots[index] & retained_slot_bit);
+    }
+
+    bool is_headroom_slot(ul64 index) const
+    {
+        return test_bit(used_bits, index) && (run_slots[index] & headroom_slot_bit);
+    }
+
+    void mark_headroom_run(ul64 start, ul64 run_pages)
+    {
+        ul64 last = start + run_pages - 1;
+
+        run_slots[start] = run_slots[last] = (u32)run_pages | headroom_slot_bit;
+        set_bit(used_bits, start);
+        set_bit(used_bits, last);
+    }
 
-        if (page_index < metadata_page_count || page_index >= page_count || pages[page_index].base_address != address)
+    // hands the headroom starting at index, if there is any, to the free runs
+    void release_headroom(ul64 index)
+    {
+        if (index >= top_page || !is_headroom_slot(index))
             return;
 
-        ul64 count = pages[page_index].size_in_pages;
+        insert_free_run(index, run_slots[index] & ~headroom_slot_bit);
+    }
 
-        if (count == 0)
+    // a run that was just freed goes to the retained cache merged with any
+    // retained neighbours. the merged run keeps the oldest neighbour's place on
+    // the age list so a run that keeps absorbing small frees still decays. when
+    // the cache is off, the run is bigger than the whole cache or no node is
+    // left it is decommitted right away
+    void retire_run(ul64 start, ul64 run_pages, u32 now = now_ms())
+    {
+        if (!decay_ms || run_pages * _page_size > retain_limit)
+        {
+            release_run(start, run_pages);
             return;
+        }
+
+        retained_pages += run_pages;
+        stats_add(stat_retained_pages, run_pages);
+        u32 node = 0;
+
+        if (start > metadata_page_count && is_retained_slot(start - 1))
+        {
+            node = run_slots[start - 1] & ~retained_slot_bit;
+            unlink_run(retained, retained_bins, retained_bitmap, node);
+
+            start = retained[node].start;
+            run_pages += retained[node].size_in_pages;
+        }
+
+        ul64 next_index = start + run_pages;
+
+        if (next_index < top_page && is_retained_slot(next_index))
+        {
+            u32 next = run_slots[next_index] & ~retained_slot_bit;
+            unlink_run(retained, retained_bins, retained_bitmap, next);
+            run_pages += retained[next].size_in_pages;
+
+            if (!node)
+                node = next;
+            else
+            {
+                u32 newer = next;
 
-        for (ul64 i = 0; i < count; ++i)
-            pages[page_index + i].base_address = nullptr;
+                if ((i32)(retained[next].retired_at - retained[node].retired_at) < 0)
+                {
+                    newer = node;
+                    node = next;
+                }
+
+                unlink_retired(newer);
+                release_retained_node(newer);
+            }
+        }
+
+        if (!node)
+        {
+            node = acquire_retained_node();
+
+            if (!node && oldest_retired)
+            {
+                purge_node(oldest_retired);
+                node = acquire_retained_node();
+            }
+
+            if (!node)
+            {
+                retained_pages -= run_pages;
+                stats_sub(stat_retained_pages, run_pages);
+                release_run(start, run_pages);
+                return;
+            }
+
+            retained_run_t& info = retained[node];
+            info.retired_at = now;
+            info.next_retired = 0;
+            info.prev_retired = newest_retired;
+
+            if (newest_retired)
+                retained[newest_retired].next_retired = node;
+            else
+                oldest_retired = node;
+
+            newest_retired = node;
+        }
+
+        retained[node].start = (u32)start;
+        retained[node].size_in_pages = (u32)run_pages;
 
-        pages[page_index].size_in_pages = 0;
+        mark_free_run(start, run_pages, node | retained_slot_bit);
+        link_run(retained, retained_bins, retained_bitmap, node);
+    }
+
+    void unlink_retired(u32 node)
+    {
+        retained_run_t& info = retained[node];
 
-        decomit(address, count * _page_size);
+        if (info.prev_retired)
+            retained[info.prev_retired].next_retired = info.next_retired;
+        else
+            oldest_retired = info.next_retired;
+
+        if (info.next_retired)
+            retained[info.next_retired].prev_retired = info.prev_retired;
+        else
+            newest_retired = info.prev_retired;
     }
 
-    void print_stats()
+    void purge_node(u32 node)
     {
-        pltf_shared_guard lock(mgr_lock);
+        ul64 start = retained[node].start;
+        ul64 run_pages = retained[node].size_in_pages;
+
+        unlink_run(retained, retained_bins, retained_bitmap, node);
+        unlink_retired(node);
+        release_retained_node(node);
 
-        ul64 committed_pages = 0;
+        retained_pages -= run_pages;
+        stats_sub(stat_retained_pages, run_pages);
+        stats_add(stat_purged_pages, run_pages);
 
-        for (ul64 i = metadata_page_count; i < page_count; ++i)
+        release_run(start, run_pages);
+    }
+
+    void purge_retained(bool all)
+    {
+        if (!oldest_retired)
+            return;
+
+        u32 now = now_ms();
+
+        while (oldest_retired && (all || now - retained[oldest_retired].retired_at >= decay_ms))
+            purge_node(oldest_retired);
+    }
+
+    bool over_retain_limit() const
+    {
+        return retained_pages * _page_size > retain_limit;
+    }
+
+    // expired runs leave the cache under the lock but are marked used, with no
+    // head bit, until release_expired decommitted them. neither a neighbour's
+    // free nor an allocation can touch them in between. a run is taken while
+    // the cache is over its limit, once it is past the decay time or with all
+    u32 take_expired(u32 now, bool all, expired_run_t* out, u32 max)
+    {
+        u32 count = 0;
+
+        while (count < max && oldest_retired &&
+            (all || over_retain_limit() || now - retained[oldest_retired].retired_at >= decay_ms))
         {
-            if (pages[i].base_address != nullptr)
-                committed_pages++;
+            out[count++] = take_oldest_retired();
         }
 
-        ul64 metadata_bytes = metadata_page_count * _page_size;
-        ul64 committed_bytes = committed_pages * _page_size;
-        ul64 total_reserved_bytes = total_reserved_size;
+        return count;
+    }
+
+    expired_run_t take_oldest_retired()
+    {
+        u32 node = oldest_retired;
+        ul64 start = retained[node].start;
+        ul64 run_pages = retained[node].size_in_pages;
 
-        std::cout << "\n=== Memory Pool Stats ===\n";
-        std::cout << "Total reserved: " << total_reserved_bytes / (1024 * 1024) << " MB (" << total_reserved_bytes << " bytes)\n";
-        std::cout << "Committed:      " << committed_bytes / (1024 * 1024) << " MB (" << committed_pages << " pages, " << committed_bytes << " bytes)\n";
-        std::cout << "Free pages:     " << (page_count - committed_pages - metadata_page_count) << "\n";
-        std::cout << "Metadata:       " << metadata_bytes / 1024 << " KB (" << metadata_page_count << " pages, " << metadata_bytes << " bytes)\n";
-        std::cout << "===========================\n";
+        unlink_run(retained, retained_bins, retained_bitmap, node);
+        unlink_retired(node);
+        release_retained_node(node);
+
+        retained_pages -= run_pages;
+        stats_sub(stat_retained_pages, run_pages);
+        stats_add(stat_purged_pages, run_pages);
+
+        mark_used_run(start, run_pages);
+        return { start, run_pages };
     }
 
-private:
-    void* pool = nullptr;
-    page_info_t* pages = nullptr;
-    pltf_mutex mgr_lock;
-    ul64 page_count = 0;
-    ul64 metadata_page_count = 0;
-    ul64 metadata_size = 0;
-    ul64 total_reserved_size = 0;
+    // decommits the taken runs outside the lock and bins them as free under
+    // it. a cache still over its limit, or any run left with all, is taken out
+    // in further rounds of at most max_expired_per_free runs
+    void release_expired(expired_run_t* expired, u32 count, bool all)
+    {
+        while (count)
+        {
+            for (u32 i = 0; i < count; ++i)
+                decomit(static_cast<char*>(pool) + expired[i].start * _page_size, expired[i].pages * _page_size);
+
+            stats_lock_guard lock(mgr_lock, PLTF_LOCK_SITE("mgr_lock"));
+
+            for (u32 i = 0; i < count; ++i)
+            {
+                insert_free_run(expired[i].start, expired[i].pages);
+                sub_committed(expired[i].pages);
+            }
+
+            count = 0;
+
+            while (count < max_expired_per_free && oldest_retired && (all || over_retain_limit()))
+                expired[count++] = take_oldest_retired();
+        }
+    }
+
+    // hands out the front of a retained run, whatever is left over stays in the
+    // cache with its original age. the pages are already committed but not zeroed
+    void* take_retained(ul64 required_pages)
+    {
+        u32 node = find_run(retained, retained_bins, retained_bitmap, required_pages);
+        if (!node)
+            return nullptr;
+
+        ul64 start = retained[node].start;
+        ul64 run_pages = retained[node].size_in_pages;
+
+        unlink_run(retained, retained_bins, retained_bitmap, node);
+
+        if (run_pages > required_pages)
+        {
+            retained[node].start += (u32)required_pages;
+            retained[node].size_in_pages -= (u32)required_pages;
+
+            mark_free_run(start + required_pages, run_pages - required_pages, node | retained_slot_bit);
+            link_run(retained, retained_bins, retained_bitmap, node);
+        }
+        else
+        {
+            unlink_retired(node);
+            release_retained_node(node);
+        }
+
+        retained_pages -= required_pages;
+        stats_sub(stat_retained_pages, required_pages);
+        mark_used_run(start, required_pages);
+        set_bit(head_bits, start);
+
+        return static_cast<char*>(pool) + start * _page_size;
+    }
 };
 
 inline virtual_memory_pool memory_pool;
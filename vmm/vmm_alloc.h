@@ -0,0 +1,146 @@
+#pragma once
+#include "vmm_export.h"
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+// adapters that put standard containers on vmm heaps and arenas. a null heap
+// handle means the general heap (halloc/hfree, thread cache included)
+
+namespace vmm {
+
+    constexpr size_t default_align = 16;
+
+    // makes tag the calling thread's memory tag until the end of the scope
+    class tag_scope
+    {
+    public:
+        explicit tag_scope(u32 tag) : previous(vmm_set_tag(tag)) {}
+        ~tag_scope() { vmm_set_tag(previous); }
+
+        tag_scope(const tag_scope&) = delete;
+        tag_scope& operator=(const tag_scope&) = delete;
+
+    private:
+        u32 previous;
+    };
+
+    inline void* heap_allocate(heap_handle_t* heap, size_t bytes, size_t align)
+    {
+        if (heap)
+            return align > default_align ? _halloc_aligned(heap, bytes, align) : _halloc(heap, bytes);
+
+        return align > default_align ? halloc_aligned(bytes, align) : halloc(bytes);
+    }
+
+    inline void heap_free(heap_handle_t* heap, void* base, size_t bytes)
+    {
+        if (heap)
+            _hfree(heap, base);
+        else
+            hfree_sized(base, bytes);
+    }
+
+    class heap_resource : public std::pmr::memory_resource
+    {
+    public:
+        explicit heap_resource(heap_handle_t* heap = nullptr) : heap(heap) {}
+
+        heap_handle_t* handle() const { return heap; }
+
+    private:
+        heap_handle_t* heap;
+
+        void* do_allocate(size_t bytes, size_t align) override
+        {
+            void* mem = heap_allocate(heap, bytes, align);
+            if (!mem)
+                throw std::bad_alloc();
+
+            return mem;
+        }
+
+        void do_deallocate(void* base, size_t bytes, size_t) override
+        {
+            heap_free(heap, base, bytes);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            auto* o = dynamic_cast<const heap_resource*>(&other);
+            return o && o->heap == heap;
+        }
+    };
+
+    // deallocate is a no-op, memory comes back with arena_reset / arena_flip
+    class arena_resource : public std::pmr::memory_resource
+    {
+    public:
+        explicit arena_resource(arena_handle_t* arena) : arena(arena) {}
+
+        arena_handle_t* handle() const { return arena; }
+
+    private:
+        arena_handle_t* arena;
+
+        void* do_allocate(size_t bytes, size_t align) override
+        {
+            void* mem = arena_alloc(arena, bytes, align);
+            if (!mem)
+                throw std::bad_alloc();
+
+            return mem;
+        }
+
+        void do_deallocate(void*, size_t, size_t) override {}
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+
+    // stateful allocator for the non pmr containers, copies compare equal when
+    // they point at the same heap so containers can swap and move freely
+    template <typename T>
+    class allocator
+    {
+    public:
+        using value_type = T;
+
+        allocator() noexcept = default;
+        explicit allocator(heap_handle_t* heap) noexcept : heap(heap) {}
+
+        template <typename U>
+        allocator(const allocator<U>& other) noexcept : heap(other.handle()) {}
+
+        // a count whose byte size doesn't fit a size_t throws like std::allocator
+        T* allocate(size_t count)
+        {
+            if (count > ~size_t(0) / sizeof(T))
+                throw std::bad_array_new_length();
+
+            void* mem = heap_allocate(heap, count * sizeof(T), alignof(T));
+            if (!mem)
+                throw std::bad_alloc();
+
+            return static_cast<T*>(mem);
+        }
+
+        void deallocate(T* base, size_t count) noexcept
+        {
+            heap_free(heap, base, count * sizeof(T));
+        }
+
+        heap_handle_t* handle() const noexcept { return heap; }
+
+        template <typename U>
+        bool operator==(const allocator<U>& other) const noexcept { return heap == other.handle(); }
+
+        template <typename U>
+        bool operator!=(const allocator<U>& other) const noexcept { return heap != other.handle(); }
+
+    private:
+        heap_handle_t* heap = nullptr;
+    };
+}
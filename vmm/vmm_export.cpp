@@ -1,57 +1,377 @@
 #include "vmm_export.h"
+#include <new>
 
 heap_handle_t* hcreate() {
-	heap_allocator_t* heap = (heap_allocator_t*)general_heap.allocate(sizeof(heap_allocator_t));
-	*heap = heap_allocator_t();
+	void* mem = general_heap.allocate(sizeof(heap_allocator_t));
+	if (!mem)
+		return nullptr;
+
+	heap_allocator_t* heap = new (mem) heap_allocator_t();
+	heap->bind(pltf_thread_id());
 	return (heap_handle_t*)heap;
 }
 
 void hdestroy(heap_handle_t* heap) {
 	if (heap) {
-		heap_allocator_t* h = (heap_allocator_t*)*heap;
+		heap_allocator_t* h = (heap_allocator_t*)heap;
 		h->destroy();
+		h->~heap_allocator_t();
 		general_heap.free(h);
-		*heap = nullptr;
 	}
 }
 
 void* _halloc(heap_handle_t* heap, size_t size) {
-	heap_allocator_t* h = (heap_allocator_t*)*heap;
+	heap_allocator_t* h = (heap_allocator_t*)heap;
 	return h->allocate(size);
 }
 
 void* _hrealloc(heap_handle_t* heap, void* base, size_t new_size) {
-	heap_allocator_t* h = (heap_allocator_t*)*heap;
+	heap_allocator_t* h = (heap_allocator_t*)heap;
 	return h->realloc(base, new_size);
 }
 
 void _hfree(heap_handle_t* heap, void* base) {
-	heap_allocator_t* h = (heap_allocator_t*)*heap;
+	heap_allocator_t* h = (heap_allocator_t*)heap;
 	return h->free(base);
 }
 
+void _hbind(heap_handle_t* heap) {
+	heap_allocator_t* h = (heap_allocator_t*)heap;
+	h->bind(pltf_thread_id());
+}
+
+void _hcollect(heap_handle_t* heap) {
+	heap_allocator_t* h = (heap_allocator_t*)heap;
+	h->collect();
+}
+
+void* _halloc_aligned(heap_handle_t* heap, size_t size, size_t align) {
+	heap_allocator_t* h = (heap_allocator_t*)heap;
+	return h->allocate_aligned(size, align);
+}
+
+size_t _halloc_batch(heap_handle_t* heap, size_t size, size_t count, void** out) {
+	heap_allocator_t* h = (heap_allocator_t*)heap;
+	return h->allocate_batch(size, count, out);
+}
+
+void _hfree_batch(heap_handle_t* heap, void** bases, size_t count) {
+	heap_allocator_t* h = (heap_allocator_t*)heap;
+	h->free_batch(bases, count);
+}
+
 void* halloc(size_t size) {
-	return general_heap.allocate(size);
+	if (heap_tcache.enabled() && size <= heap_allocator_t::small_size_limit)
+		return heap_tcache.allocate(size);
+
+	return heap_shards.local().allocate(size);
 }
 
 void* hrealloc(void* base, size_t new_size) {
-	return general_heap.realloc(base, new_size);
+	return heap_shards.local().realloc(base, new_size);
 }
 
+// any heap hands a block on to the shard that owns it
 void hfree(void* base) {
+	if (base && heap_tcache.enabled() && heap_tcache.free(base))
+		return;
+
 	return general_heap.free(base);
 }
 
-void* valloc(size_t size) {
-	return memory_pool.allocate(size);
+void hcollect() {
+	heap_shards.collect();
+}
+
+void* halloc_aligned(size_t size, size_t align) {
+	return heap_shards.local().allocate_aligned(size, align);
+}
+
+void hfree_sized(void* base, size_t size) {
+	if (base && heap_tcache.enabled() && heap_tcache.free_sized(base, size))
+		return;
+
+	general_heap.free(base);
+}
+
+size_t halloc_usable_size(void* base) {
+	return heap_allocator_t::usable_size(base);
+}
+
+size_t halloc_batch(size_t size, size_t count, void** out) {
+	return heap_shards.local().allocate_batch(size, count, out);
+}
+
+void hfree_batch(void** bases, size_t count) {
+	general_heap.free_batch(bases, count);
+}
+
+void* _halloc_tagged(heap_handle_t* heap, size_t size, u32 tag) {
+	heap_allocator_t* h = (heap_allocator_t*)heap;
+	return h->allocate(size, tag < max_memory_tags ? tag : default_memory_tag);
+}
+
+void* halloc_tagged(size_t size, u32 tag) {
+	if (tag >= max_memory_tags)
+		tag = default_memory_tag;
+
+	if (heap_tcache.enabled() && size <= heap_allocator_t::small_size_limit)
+		return heap_tcache.allocate(size, tag);
+
+	return heap_shards.local().allocate(size, tag);
+}
+
+u32 vmm_set_tag(u32 tag) {
+	return set_memory_tag(tag);
+}
+
+u32 vmm_get_tag() {
+	return current_memory_tag();
+}
+
+void vmm_set_budget(u32 tag, size_t soft_limit, size_t hard_limit) {
+	memory_budgets.set(tag, soft_limit, hard_limit);
+}
+
+void vmm_set_budget_callback(vmm_budget_callback_t callback) {
+	memory_budgets.set_callback(callback);
+}
+
+void htcache_enable() {
+	heap_tcache.enable(&heap_shards.local());
+}
+
+void htcache_disable() {
+	heap_tcache.disable();
+}
+
+void htcache_flush() {
+	heap_tcache.flush();
+}
+
+void* valloc(size_t size) VMM_VALLOC_NOEXCEPT {
+	return numa_pools.allocate(size);
+}
+
+void* valloc_node(size_t size, u32 node) {
+	return numa_pools.node(node).allocate(size);
+}
+
+void* valloc_huge(size_t size) {
+	return numa_pools.local().allocate_huge(size);
+}
+
+void* valloc_reserved(size_t size, size_t max_size) {
+	return numa_pools.local().allocate_reserved(size, max_size);
 }
 
 void vfree(void* base) {
-	return memory_pool.free(base);
+	return numa_pools.free(base);
 }
 
 void* vrealloc(void* base, size_t new_size) {
-	return memory_pool.realloc(base, new_size);
+	return numa_pools.realloc(base, new_size);
+}
+
+arena_handle_t* arena_create(size_t capacity, bool double_buffered) {
+	void* mem = general_heap.allocate(sizeof(arena_t));
+	if (!mem)
+		return nullptr;
+
+	arena_t* arena = new (mem) arena_t();
+	if (!arena->initialize(&numa_pools.local(), capacity, double_buffered)) {
+		general_heap.free(mem);
+		return nullptr;
+	}
+
+	return (arena_handle_t*)arena;
+}
+
+void arena_destroy(arena_handle_t* arena) {
+	if (arena) {
+		arena_t* a = (arena_t*)arena;
+		a->destroy();
+		a->~arena_t();
+		general_heap.free(a);
+	}
+}
+
+void* arena_alloc(arena_handle_t* arena, size_t size, size_t align) {
+	arena_t* a = (arena_t*)arena;
+	return a->allocate(size, align ? align : arena_t::default_align);
+}
+
+void arena_reset(arena_handle_t* arena) {
+	arena_t* a = (arena_t*)arena;
+	a->reset();
+}
+
+size_t arena_mark(arena_handle_t* arena) {
+	arena_t* a = (arena_t*)arena;
+	return a->mark();
+}
+
+void arena_rewind(arena_handle_t* arena, size_t mark) {
+	arena_t* a = (arena_t*)arena;
+	a->rewind(mark);
+}
+
+void arena_flip(arena_handle_t* arena) {
+	arena_t* a = (arena_t*)arena;
+	a->flip();
+}
+
+pool_handle_t* pool_create(size_t size, size_t align) {
+	void* mem = general_heap.allocate(sizeof(fixed_pool_t));
+	if (!mem)
+		return nullptr;
+
+	fixed_pool_t* pool = new (mem) fixed_pool_t();
+	if (!pool->initialize(&numa_pools.local(), size, align)) {
+		general_heap.free(mem);
+		return nullptr;
+	}
+
+	return (pool_handle_t*)pool;
+}
+
+void pool_destroy(pool_handle_t* pool) {
+	if (pool) {
+		fixed_pool_t* p = (fixed_pool_t*)pool;
+		p->destroy();
+		p->~fixed_pool_t();
+		general_heap.free(p);
+	}
+}
+
+void* pool_alloc(pool_handle_t* pool) {
+	fixed_pool_t* p = (fixed_pool_t*)pool;
+	return p->allocate();
+}
+
+void pool_free(pool_handle_t* pool, void* base) {
+	fixed_pool_t* p = (fixed_pool_t*)pool;
+	p->free(base);
+}
+
+void hretire(void* base) {
+	epoch_reclaimer.retire(base);
+}
+
+static void reset_retired_arena(void* arena) {
+	((arena_t*)arena)->reset();
+}
+
+void arena_retire(arena_handle_t* arena) {
+	epoch_reclaimer.retire(arena, reset_retired_arena);
+}
+
+void vmm_retire(void* object, vmm_reclaim_fn reclaim) {
+	epoch_reclaimer.retire(object, reclaim);
+}
+
+void vmm_quiescent() {
+	epoch_reclaimer.quiescent();
+}
+
+void vmm_thread_offline() {
+	epoch_reclaimer.offline();
+}
+
+void vmm_thread_online() {
+	epoch_reclaimer.online();
+}
+
+u32 vmm_set_heap_shards(u32 count, u32 mode) {
+	return heap_shards.configure(count, mode == VMM_HEAP_SHARDS_BY_CPU ? heap_shard_by_cpu : heap_shard_round_robin);
+}
+
+void vmm_purge() {
+	numa_pools.purge(true);
+}
+
+void vmm_set_decay(u32 decay_ms, size_t retain_limit) {
+	numa_pools.set_decay(decay_ms, retain_limit);
+}
+
+static_assert(VMM_STATS_SIZE_CLASSES == stats_size_classes, "vmm_stats size classes out of sync with stats.h");
+static_assert(VMM_MEMORY_TAGS == max_memory_tags, "vmm_stats tags out of sync with stats.h");
+static_assert(VMM_NUMA_NODES == max_numa_nodes, "vmm_stats numa nodes out of sync with stats.h");
+
+// the blocks are summed one after another while other threads keep counting,
+// a free can be seen without the allocation it pairs with
+static size_t stats_difference(u64 added, u64 removed) {
+	return added > removed ? (size_t)(added - removed) : 0;
+}
+
+// counters kept as wrapped deltas
+static size_t stats_balance(u64 total) {
+	return (i64)total > 0 ? (size_t)total : 0;
+}
+
+void vmm_get_stats(vmm_stats* stats) {
+	u64 totals[stat_count];
+	stats_registry.snapshot(totals);
+
+	stats->bytes_allocated = totals[stat_bytes_allocated];
+	stats->bytes_freed = totals[stat_bytes_freed];
+	stats->bytes_live = stats_difference(totals[stat_bytes_allocated], totals[stat_bytes_freed]);
+	stats->bytes_reserved = numa_pools.reserved_bytes();
+	stats->bytes_committed = stats_difference(totals[stat_pages_committed], totals[stat_pages_decommitted]) * _page_size;
+	stats->bytes_committed_peak = numa_pools.committed_peak_bytes();
+	stats->bytes_retained = stats_balance(totals[stat_retained_pages]) * _page_size;
+	stats->bytes_purged = totals[stat_purged_pages] * _page_size;
+	stats->bytes_metadata = stats_balance(totals[stat_metadata_bytes]);
+	stats->page_commits = totals[stat_pages_committed];
+	stats->page_decommits = totals[stat_pages_decommitted];
+	stats->tcache_hits = totals[stat_tcache_hits];
+	stats->lock_contentions = totals[stat_lock_contentions];
+	stats->lock_wait_ns = totals[stat_lock_wait_ns];
+
+	for (u32 i = 0; i < stats_size_classes; ++i) {
+		stats->alloc_ops[i] = totals[stat_alloc_ops + i];
+		stats->free_ops[i] = totals[stat_free_ops + i];
+	}
+
+	for (u32 i = 0; i < max_memory_tags; ++i)
+		stats->bytes_by_tag[i] = stats_balance(totals[stat_tag_bytes + i]);
+
+	stats->numa_nodes = numa_pools.count();
+
+	for (u32 i = 0; i < max_numa_nodes; ++i)
+		stats->bytes_committed_by_node[i] = stats_balance(totals[stat_node_pages + i]) * _page_size;
+
+	stats->objects_retired = totals[stat_objects_retired];
+	stats->objects_reclaimed = totals[stat_objects_reclaimed];
+}
+
+size_t vmm_get_lock_profile(vmm_lock_profile* locks, size_t max) {
+#ifdef PLTF_LOCK_PROFILE
+	pltf_lock_profile_entry entries[pltf_lock_profiler_t::max_sites + 1];
+	u32 count = pltf_lock_profiler.snapshot(entries, (u32)std::min<size_t>(max, pltf_lock_profiler_t::max_sites + 1));
+
+	for (u32 i = 0; i < count; ++i) {
+		locks[i].name = entries[i].name;
+		locks[i].acquires = entries[i].acquires;
+		locks[i].contended = entries[i].contended;
+		locks[i].wait_ns = entries[i].wait_ns;
+		locks[i].max_wait_ns = entries[i].max_wait_ns;
+		locks[i].hold_ns = entries[i].hold_ns;
+		locks[i].max_hold_ns = entries[i].max_hold_ns;
+	}
+
+	return count;
+#else
+	(void)locks;
+	(void)max;
+	return 0;
+#endif
+}
+
+void vmm_reset_lock_profile() {
+#ifdef PLTF_LOCK_PROFILE
+	pltf_lock_profiler.reset();
+#endif
 }
 
 
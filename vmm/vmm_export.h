@@ -2,12 +2,101 @@
 
 #ifdef VMM
 #define VMM_API API_EXPORT
-#include "heap.h"
+#include "tcache.h"
+#include "heap_shards.h"
+#include "arena.h"
+#include "pool.h"
+#include "epoch.h"
 #else
 #define VMM_API API_IMPORT
 #include <datatypes.h>
 #endif
 
+// glibc declares its own valloc, ours has to match it and link under another
+// symbol so it doesn't interpose the libc one for the whole process
+#ifdef PLATFORM_LINUX
+#define VMM_VALLOC_NOEXCEPT noexcept
+#define VMM_VALLOC_LABEL __asm__("vmm_valloc")
+#else
+#define VMM_VALLOC_NOEXCEPT
+#define VMM_VALLOC_LABEL
+#endif
+
+#define VMM_STATS_SIZE_CLASSES 16
+#define VMM_MEMORY_TAGS 64
+#define VMM_NUMA_NODES 16
+
+// memory tags for the engine's subsystems, game code can use its own from
+// VMM_TAG_USER up to VMM_MEMORY_TAGS - 1
+enum vmm_memory_tag {
+	VMM_TAG_GENERAL = 0,
+	VMM_TAG_ECS,
+	VMM_TAG_RENDER,
+	VMM_TAG_PHYSICS,
+	VMM_TAG_AUDIO,
+	VMM_TAG_SCRIPT,
+	VMM_TAG_USER = 16
+};
+
+// how threads are spread over the general heap's shards, see
+// vmm_set_heap_shards
+enum vmm_heap_shard_mode {
+	VMM_HEAP_SHARDS_ROUND_ROBIN = 0,
+	VMM_HEAP_SHARDS_BY_CPU
+};
+
+// called on the allocating thread when a tag goes over its soft budget, or
+// with hard set when an allocation was refused for going over the hard one
+typedef void (*vmm_budget_callback_t)(u32 tag, size_t used, size_t budget, bool hard);
+
+// totals over every thread since start up, gathered without taking any lock so
+// it can be sampled every frame. bytes are block sizes as the heaps hand them
+// out, a realloc counts as a free of the old block and an allocation of the
+// new one. alloc_ops and free_ops are binned by power of two size class, class
+// 0 is up to 16 bytes and the last class is everything past 256 KiB. committed
+// bytes are pages of the memory pool in use by runs, retained runs included,
+// metadata is counted on its own. bytes_by_tag is the live bytes of every
+// memory tag. bytes_committed_by_node splits the committed bytes by the numa
+// node the pool pages were placed on, only the first numa_nodes are used.
+// objects_retired counts the objects hretire, vmm_retire and arena_retire
+// put in limbo, objects_reclaimed the ones of them that were reclaimed since
+struct vmm_stats {
+	size_t bytes_allocated;
+	size_t bytes_freed;
+	size_t bytes_live;
+	size_t bytes_reserved;
+	size_t bytes_committed;
+	size_t bytes_committed_peak;
+	size_t bytes_retained;
+	size_t bytes_purged;
+	size_t bytes_metadata;
+	size_t page_commits;
+	size_t page_decommits;
+	size_t tcache_hits;
+	size_t lock_contentions;
+	size_t lock_wait_ns;
+	size_t alloc_ops[VMM_STATS_SIZE_CLASSES];
+	size_t free_ops[VMM_STATS_SIZE_CLASSES];
+	size_t bytes_by_tag[VMM_MEMORY_TAGS];
+	size_t numa_nodes;
+	size_t bytes_committed_by_node[VMM_NUMA_NODES];
+	size_t objects_retired;
+	size_t objects_reclaimed;
+};
+
+// the allocator's own locks by name, only counted when the library is built
+// with PLTF_LOCK_PROFILE, vmm_get_lock_profile returns 0 otherwise. waits are
+// of the acquisitions that found the lock held
+struct vmm_lock_profile {
+	const char* name;
+	size_t acquires;
+	size_t contended;
+	size_t wait_ns;
+	size_t max_wait_ns;
+	size_t hold_ns;
+	size_t max_hold_ns;
+};
+
 extern "C" {
 
 	typedef void* heap_handle_t;
@@ -18,12 +107,82 @@ extern "C" {
 	VMM_API void* _halloc(heap_handle_t* heap, size_t size);
 	VMM_API void* _hrealloc(heap_handle_t* heap, void* base, size_t new_size);
 	VMM_API void  _hfree(heap_handle_t* heap, void* base);
+	VMM_API void  _hbind(heap_handle_t* heap);
+	VMM_API void  _hcollect(heap_handle_t* heap);
+	VMM_API void* _halloc_aligned(heap_handle_t* heap, size_t size, size_t align);
+	VMM_API size_t _halloc_batch(heap_handle_t* heap, size_t size, size_t count, void** out);
+	VMM_API void  _hfree_batch(heap_handle_t* heap, void** bases, size_t count);
 
 	VMM_API void* halloc(size_t size);
 	VMM_API void* hrealloc(void* base, size_t new_size);
 	VMM_API void  hfree(void* base);
+	VMM_API void  hcollect();
+
+	VMM_API void* halloc_aligned(size_t size, size_t align);
+	VMM_API void  hfree_sized(void* base, size_t size);
+	VMM_API size_t halloc_usable_size(void* base);
+	VMM_API size_t halloc_batch(size_t size, size_t count, void** out);
+	VMM_API void  hfree_batch(void** bases, size_t count);
 
-	VMM_API void* valloc(size_t size);
+	VMM_API void* _halloc_tagged(heap_handle_t* heap, size_t size, u32 tag);
+	VMM_API void* halloc_tagged(size_t size, u32 tag);
+	VMM_API u32   vmm_set_tag(u32 tag);
+	VMM_API u32   vmm_get_tag();
+	VMM_API void  vmm_set_budget(u32 tag, size_t soft_limit, size_t hard_limit);
+	VMM_API void  vmm_set_budget_callback(vmm_budget_callback_t callback);
+
+	VMM_API void  htcache_enable();
+	VMM_API void  htcache_disable();
+	VMM_API void  htcache_flush();
+
+	VMM_API void* valloc(size_t size) VMM_VALLOC_NOEXCEPT VMM_VALLOC_LABEL;
+	VMM_API void* valloc_huge(size_t size);
+	// pages placed on the given numa node instead of the calling thread's, a
+	// node the machine doesn't have falls back to the calling thread's
+	VMM_API void* valloc_node(size_t size, u32 node);
+	VMM_API void* valloc_reserved(size_t size, size_t max_size);
 	VMM_API void* vrealloc(void* base, size_t new_size);
 	VMM_API void  vfree(void* base);
+
+	typedef void* arena_handle_t;
+
+	VMM_API arena_handle_t* arena_create(size_t capacity, bool double_buffered);
+	VMM_API void   arena_destroy(arena_handle_t* arena);
+	VMM_API void*  arena_alloc(arena_handle_t* arena, size_t size, size_t align);
+	VMM_API void   arena_reset(arena_handle_t* arena);
+	VMM_API size_t arena_mark(arena_handle_t* arena);
+	VMM_API void   arena_rewind(arena_handle_t* arena, size_t mark);
+	VMM_API void   arena_flip(arena_handle_t* arena);
+
+	typedef void* pool_handle_t;
+
+	VMM_API pool_handle_t* pool_create(size_t size, size_t align);
+	VMM_API void  pool_destroy(pool_handle_t* pool);
+	VMM_API void* pool_alloc(pool_handle_t* pool);
+	VMM_API void  pool_free(pool_handle_t* pool, void* base);
+
+	// deferred reclamation, see epoch.h. a retired object is reclaimed once
+	// every thread that takes part went through a quiescent point after the
+	// call: hretire frees a heap block, arena_retire resets an arena and
+	// vmm_retire calls reclaim on the object, a null reclaim frees it as a
+	// heap block. threads announce quiescent
+	// points at frame and tick boundaries and go offline while they block
+	typedef void (*vmm_reclaim_fn)(void* object);
+
+	VMM_API void  hretire(void* base);
+	VMM_API void  arena_retire(arena_handle_t* arena);
+	VMM_API void  vmm_retire(void* object, vmm_reclaim_fn reclaim);
+	VMM_API void  vmm_quiescent();
+	VMM_API void  vmm_thread_offline();
+	VMM_API void  vmm_thread_online();
+
+	// splits the general heap into count independent heaps, 0 is one per core
+	// and also the default. returns the count in use
+	VMM_API u32   vmm_set_heap_shards(u32 count, u32 mode);
+
+	VMM_API void  vmm_purge();
+	VMM_API void  vmm_set_decay(u32 decay_ms, size_t retain_limit);
+	VMM_API void  vmm_get_stats(struct vmm_stats* stats);
+	VMM_API size_t vmm_get_lock_profile(struct vmm_lock_profile* locks, size_t max);
+	VMM_API void  vmm_reset_lock_profile();
 } 
@@ -0,0 +1,50 @@
+#pragma once
+#include "vmm_export.h"
+#include <new>
+
+// opt-in replacement of the global allocation functions with the vmm general
+// heap. include this in exactly one translation unit of the executable, every
+// new/delete in the program (std containers included) then goes through
+// halloc/hfree. sized deletes skip the header lookup in the thread cache
+
+inline void* vmm_new(size_t size)
+{
+    void* mem = halloc(size);
+    if (!mem)
+        throw std::bad_alloc();
+
+    return mem;
+}
+
+inline void* vmm_new_aligned(size_t size, std::align_val_t align)
+{
+    void* mem = halloc_aligned(size, (size_t)align);
+    if (!mem)
+        throw std::bad_alloc();
+
+    return mem;
+}
+
+void* operator new(size_t size) { return vmm_new(size); }
+void* operator new[](size_t size) { return vmm_new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return halloc(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return halloc(size); }
+
+void* operator new(size_t size, std::align_val_t align) { return vmm_new_aligned(size, align); }
+void* operator new[](size_t size, std::align_val_t align) { return vmm_new_aligned(size, align); }
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return halloc_aligned(size, (size_t)align); }
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return halloc_aligned(size, (size_t)align); }
+
+void operator delete(void* base) noexcept { hfree(base); }
+void operator delete[](void* base) noexcept { hfree(base); }
+void operator delete(void* base, const std::nothrow_t&) noexcept { hfree(base); }
+void operator delete[](void* base, const std::nothrow_t&) noexcept { hfree(base); }
+void operator delete(void* base, size_t size) noexcept { hfree_sized(base, size); }
+void operator delete[](void* base, size_t size) noexcept { hfree_sized(base, size); }
+
+void operator delete(void* base, std::align_val_t) noexcept { hfree(base); }
+void operator delete[](void* base, std::align_val_t) noexcept { hfree(base); }
+void operator delete(void* base, std::align_val_t, const std::nothrow_t&) noexcept { hfree(base); }
+void operator delete[](void* base, std::align_val_t, const std::nothrow_t&) noexcept { hfree(base); }
+void operator delete(void* base, size_t size, std::align_val_t) noexcept { hfree_sized(base, size); }
+void operator delete[](void* base, size_t size, std::align_val_t) noexcept { hfree_sized(base, size); }